@@ -851,6 +851,48 @@ inline std::vector<char> query_database(const T& request) {
     return result;
 }
 
+/// \exclude
+extern "C" void
+query_database_batch(void* req_begin, void* req_end, void* cb_alloc_data, void* (*cb_alloc)(void* cb_alloc_data, size_t size));
+
+/// \exclude
+inline std::vector<std::vector<char>> query_database_batch_packed(const std::vector<std::vector<char>>& packed) {
+    auto              req_data = pack(packed);
+    std::vector<char> bin;
+    auto              alloc_fn = [&bin](size_t size) {
+        bin.resize(size);
+        return bin.data();
+    };
+    query_database_batch(req_data.data(), req_data.data() + req_data.size(), &alloc_fn, [](void* cb_alloc_data, size_t size) -> void* {
+        return (*reinterpret_cast<decltype(alloc_fn)*>(cb_alloc_data))(size);
+    });
+    std::vector<std::vector<char>> result;
+    datastream<const char*>        ds(bin.data(), bin.size());
+    ds >> result;
+    return result;
+}
+
+/// \output_section Query Database
+/// Query the database several times in one call. Each element of `requests` must be one of the `query_*` structs.
+/// Returns one result per request, in the same order. Each result has the form `query_database(request)` returns.
+///
+/// This costs one host call instead of one per request, and lets the server overlap the queries.
+template <typename T>
+inline std::vector<std::vector<char>> query_database_batch(const std::vector<T>& requests) {
+    std::vector<std::vector<char>> packed;
+    packed.reserve(requests.size());
+    for (auto& request : requests)
+        packed.push_back(pack(request));
+    return query_database_batch_packed(packed);
+}
+
+/// \output_section Query Database
+/// Like `query_database_batch(requests)`, but the requests may be different `query_*` structs.
+template <typename T0, typename T1, typename... Ts>
+inline std::vector<std::vector<char>> query_database_batch(const T0& request0, const T1& request1, const Ts&... requests) {
+    return query_database_batch_packed({pack(request0), pack(request1), pack(requests)...});
+}
+
 /// Unpack each record of a query result and call `f(record)`. `T` is the record type.
 template <typename T, typename F>
 bool for_each_query_result(const std::vector<char>& bytes, F f) {
@@ -888,6 +930,63 @@ bool for_each_contract_row(const std::vector<char>& bytes, F f) {
     });
 }
 
+/// \exclude
+extern "C" uint32_t query_open(void* req_begin, void* req_end);
+
+/// \exclude
+extern "C" void query_next_batch(uint32_t cursor, uint32_t max_rows, void* cb_alloc_data, void* (*cb_alloc)(void* cb_alloc_data, size_t size));
+
+/// \output_section Query Database
+/// Open a cursor over the results of `request`, which must be one of the `query_*` structs. Unlike
+/// `query_database`, the results arrive a batch at a time through `query_next_batch`.
+/// Cursors still open when the query finishes are closed automatically.
+template <typename T>
+inline uint32_t query_open(const T& request) {
+    auto req_data = pack(request);
+    return query_open(req_data.data(), req_data.data() + req_data.size());
+}
+
+/// \output_section Query Database
+/// Fetch up to `max_rows` more records from a cursor. The result has the same form as `query_database`'s
+/// result; it holds no records once the cursor is exhausted.
+inline std::vector<char> query_next_batch(uint32_t cursor, uint32_t max_rows) {
+    std::vector<char> result;
+    auto              alloc_fn = [&result](size_t size) {
+        result.resize(size);
+        return result.data();
+    };
+    query_next_batch(cursor, max_rows, &alloc_fn, [](void* cb_alloc_data, size_t size) -> void* {
+        return (*reinterpret_cast<decltype(alloc_fn)*>(cb_alloc_data))(size);
+    });
+    return result;
+}
+
+/// \output_section Query Database
+/// Close a cursor opened by `query_open`.
+extern "C" void query_close(uint32_t cursor);
+
+/// \output_section Query Database
+/// Run `request` through a cursor, `batch_size` records at a time, unpacking each record and calling `f(record)`.
+/// `T` is the record type. Stops early if `f` returns false. Only one batch is in memory at a time.
+template <typename T, typename Request, typename F>
+bool for_each_query_cursor_result(const Request& request, uint32_t batch_size, F f) {
+    auto cursor = query_open(request);
+    while (true) {
+        auto                    bytes = query_next_batch(cursor, batch_size);
+        datastream<const char*> ds(bytes.data(), bytes.size());
+        unsigned_int            size;
+        ds >> size;
+        if (!size.value)
+            break;
+        if (!for_each_query_result<T>(bytes, f)) {
+            query_close(cursor);
+            return false;
+        }
+    }
+    query_close(cursor);
+    return true;
+}
+
 /// \exclude
 extern "C" void query_database(void* req_begin, void* req_end, void* cb_alloc_data, void* (*cb_alloc)(void* cb_alloc_data, size_t size));
 
@@ -36,6 +36,10 @@ inline std::vector<char> get_input_data() {
 extern "C" {
 /// Set the wasm's output data
 void set_output_data(const char* begin, const char* end);
+
+/// Append to the wasm's output data. The server may send large outputs to the client in chunks
+/// while the wasm is still running; set_output_data can't be used after that happens.
+void append_output_data(const char* begin, const char* end);
 }
 
 /// Set the wasm's output data
@@ -47,4 +51,10 @@ inline void set_output_data(const std::string_view& v) { set_output_data(v.data(
 /// Set the wasm's output data
 inline void set_output_data(rope v) { return set_output_data(v.sv()); }
 
+/// Append to the wasm's output data
+inline void append_output_data(const std::vector<char>& v) { append_output_data(v.data(), v.data() + v.size()); }
+
+/// Append to the wasm's output data
+inline void append_output_data(const std::string_view& v) { append_output_data(v.data(), v.data() + v.size()); }
+
 } // namespace eosio
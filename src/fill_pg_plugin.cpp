@@ -90,6 +90,7 @@ struct fpg_session : connection_callbacks, std::enable_shared_from_this<fpg_sess
     uint32_t                                             first           = 0;
     uint32_t                                             first_bulk      = 0;
     std::map<std::string, std::unique_ptr<table_stream>> table_streams;
+    std::shared_ptr<fill_metrics>                        stats = app().find_plugin<fill_plugin>()->get_metrics();
 
     fpg_session(fill_postgresql_plugin_impl* my)
         : my(my)
@@ -539,16 +540,20 @@ struct fpg_session : connection_callbacks, std::enable_shared_from_this<fpg_sess
        irreversible_id = to_string(result.last_irreversible.block_id);
        if (!first)
            first = head;
+       stats->received_block(head, irreversible);
        if (!bulk)
            write_fill_status(t, pipeline);
        pipeline.insert(
            "insert into " + t.quote_name(config->schema) + ".received_block (block_num, block_id) values (" +
            std::to_string(result.this_block->block_num) + ", " + quote(to_string(result.this_block->block_id)) + ")");
 
+       auto start = std::chrono::steady_clock::now();
        pipeline.complete();
        while(!pipeline.empty())
            pipeline.retrieve();
        t.commit();
+       if (!bulk)
+           stats->committed(1, start);
        if (large_deltas)
            close_streams();
        return true;
@@ -603,16 +608,20 @@ struct fpg_session : connection_callbacks, std::enable_shared_from_this<fpg_sess
         irreversible_id = to_string(result.last_irreversible.block_id);
         if (!first)
             first = head;
+        stats->received_block(head, irreversible);
         if (!bulk)
             write_fill_status(t, pipeline);
         pipeline.insert(
             "insert into " + t.quote_name(config->schema) + ".received_block (block_num, block_id) values (" +
             std::to_string(result.this_block->block_num) + ", " + quote(to_string(result.this_block->block_id)) + ")");
 
+        auto start = std::chrono::steady_clock::now();
         pipeline.complete();
         while(!pipeline.empty())
             pipeline.retrieve();
         t.commit();
+        if (!bulk)
+            stats->committed(1, start);
         if (large_deltas)
             close_streams();
         return true;
@@ -630,6 +639,7 @@ struct fpg_session : connection_callbacks, std::enable_shared_from_this<fpg_sess
     void close_streams() {
         if (table_streams.empty())
             return;
+        auto start = std::chrono::steady_clock::now();
         for (auto& [_, ts] : table_streams) {
             ts->writer.complete();
             ts->t.commit();
@@ -643,6 +653,7 @@ struct fpg_session : connection_callbacks, std::enable_shared_from_this<fpg_sess
         pipeline.complete();
         t.commit();
 
+        stats->committed(head >= first_bulk ? head - first_bulk + 1 : 0, start);
         ilog("block ${b} - ${e}", ("b", first_bulk)("e", head));
         first_bulk = 0;
     }
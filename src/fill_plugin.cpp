@@ -23,11 +23,27 @@ void fill_plugin::set_program_options(options_description& cli, options_descript
     clop("fill-skip-to,k", bpo::value<uint32_t>(), "Skip blocks before [arg]");
     clop("fill-stop,x", bpo::value<uint32_t>(), "Stop before block [arg]");
     clop("fill-trx", bpo::value<std::vector<std::string>>(), "Filter transactions 'include:status:receiver:act_account:act_name'");
+    op("fill-metrics-listen", bpo::value<std::string>(), "Endpoint to serve metrics on at /metrics, in Prometheus text format (default: disabled)");
 }
 
-void fill_plugin::plugin_initialize(const variables_map& options) {}
-void fill_plugin::plugin_startup() {}
-void fill_plugin::plugin_shutdown() {}
+void fill_plugin::plugin_initialize(const variables_map& options) {
+    try {
+        if (options.count("fill-metrics-listen"))
+            listener =
+                std::make_shared<metrics::listener>(app().get_io_service(), options["fill-metrics-listen"].as<std::string>(), stats->registry);
+    }
+    FC_LOG_AND_RETHROW()
+}
+
+void fill_plugin::plugin_startup() {
+    if (listener)
+        listener->start();
+}
+
+void fill_plugin::plugin_shutdown() {
+    if (listener)
+        listener->stop();
+}
 
 std::vector<state_history::trx_filter> fill_plugin::get_trx_filters(const variables_map& options) {
     try {
@@ -1,9 +1,42 @@
 // copyright defined in LICENSE.txt
 
 #pragma once
+#include "metrics.hpp"
 #include "state_history.hpp"
 #include <appbase/application.hpp>
 
+// Metrics the fill plugins report at --fill-metrics-listen
+struct fill_metrics {
+    std::shared_ptr<metrics::registry> registry = std::make_shared<metrics::registry>();
+    metrics::counter&                  blocks;
+    metrics::gauge&                    head;
+    metrics::gauge&                    irreversible;
+    metrics::gauge&                    lag;
+    metrics::histogram&                batch_blocks;
+    metrics::histogram&                flush_seconds;
+
+    fill_metrics()
+        : blocks(registry->get_counter("fill_blocks_total", "Blocks received"))
+        , head(registry->get_gauge("fill_head", "Newest block received"))
+        , irreversible(registry->get_gauge("fill_irreversible", "Last irreversible block, as nodeos last reported it"))
+        , lag(registry->get_gauge("fill_lag_blocks", "How far the newest block received is behind last irreversible"))
+        , batch_blocks(registry->get_histogram("fill_batch_blocks", "Blocks per database commit", metrics::size_bounds()))
+        , flush_seconds(registry->get_histogram("fill_flush_seconds", "Time to commit a batch", metrics::latency_bounds())) {}
+
+    void received_block(uint32_t block_num, uint32_t last_irreversible) {
+        blocks.add();
+        head.set(block_num);
+        irreversible.set(last_irreversible);
+        lag.set(last_irreversible > block_num ? last_irreversible - block_num : 0);
+    }
+
+    // Records one commit of num_blocks blocks which started at start
+    void committed(uint32_t num_blocks, std::chrono::steady_clock::time_point start) {
+        batch_blocks.observe(num_blocks);
+        flush_seconds.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+};
+
 class fill_plugin : public appbase::plugin<fill_plugin> {
   public:
     APPBASE_PLUGIN_REQUIRES()
@@ -17,4 +50,10 @@ class fill_plugin : public appbase::plugin<fill_plugin> {
     void         plugin_shutdown();
 
     static std::vector<state_history::trx_filter> get_trx_filters(const appbase::variables_map& options);
+
+    const std::shared_ptr<fill_metrics>& get_metrics() const { return stats; }
+
+  private:
+    std::shared_ptr<fill_metrics>      stats = std::make_shared<fill_metrics>();
+    std::shared_ptr<metrics::listener> listener;
 };
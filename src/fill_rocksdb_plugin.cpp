@@ -79,6 +79,7 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
     fill_rocksdb_plugin_impl*                  my = nullptr;
     std::shared_ptr<fill_rocksdb_config>       config;
     std::shared_ptr<::rocksdb_inst>            rocksdb_inst = app().find_plugin<rocksdb_plugin>()->get_rocksdb_inst(false);
+    std::shared_ptr<fill_metrics>              stats        = app().find_plugin<fill_plugin>()->get_metrics();
     rocksdb::WriteBatch                        active_content_batch;
     rocksdb::WriteBatch                        active_index_batch;
     std::shared_ptr<state_history::connection> connection;
@@ -91,6 +92,7 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
     uint32_t                                   irreversible       = 0;
     abieos::checksum256                        irreversible_id    = {};
     uint32_t                                   first              = 0;
+    uint32_t                                   batch_blocks       = 0; // received since the last commit
 
     flm_session(fill_rocksdb_plugin_impl* my)
         : my(my)
@@ -382,6 +384,8 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
     }
 
     void truncate(uint32_t block) {
+        // let wasm-ql queries running against the blocks we're about to remove know they need to retry
+        ++rocksdb_inst->fork_generation;
         rocksdb_inst->database.flush(true, true);
         rocksdb::WriteBatch content_batch, index_batch;
         uint64_t            num_rows    = 0;
@@ -429,24 +433,6 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
             return false;
         }
 
-        /*
-        if (result.this_block->block_num >= 40013524) {
-            end_write(true);
-            {
-                std::string ss;
-                rocksdb_inst->database.db->GetProperty("rocksdb.stats", &ss);
-                std::cout << ss << "\n";
-            }
-            rocksdb_inst->database.flush(true, true);
-            {
-                std::string ss;
-                rocksdb_inst->database.db->GetProperty("rocksdb.stats", &ss);
-                std::cout << ss << "\n";
-            }
-            _exit(0);
-        }
-        */
-
         try {
             if (result.this_block->block_num <= head) {
                 ilog("switch forks at block ${b}", ("b", result.this_block->block_num));
@@ -476,13 +462,18 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
             irreversible_id = result.last_irreversible.block_id;
             if (!first)
                 first = head;
+            stats->received_block(head, irreversible);
+            ++batch_blocks;
 
             rdb::put(
                 active_content_batch, kv::make_received_block_key(result.this_block->block_num),
                 kv::received_block{result.this_block->block_num, result.this_block->block_id});
 
             if (commit_now) {
+                auto start = std::chrono::steady_clock::now();
                 end_write(true);
+                stats->committed(batch_blocks, start);
+                batch_blocks = 0;
                 if (config->enable_trim)
                     trim();
             }
@@ -547,7 +538,7 @@ struct flm_session : connection_callbacks, std::enable_shared_from_this<flm_sess
             kv::append_index_key(index_key, table.kv_table->short_name, index->short_name);
             kv::extract_keys(index_key, {value.data(), value.data() + value.size()}, index->sort_keys, positions);
             kv::append_index_suffix(index_key, block_num, present_k);
-            index_batch.Put(rdb::to_slice(index_key), {});
+            index_batch.Put(rdb::to_slice(index_key), index->covering ? rdb::to_slice(value) : rocksdb::Slice{});
         }
     }
 
@@ -859,6 +850,7 @@ void fill_rocksdb_plugin::plugin_initialize(const variables_map& options) {
         my->config->trx_filters  = fill_plugin::get_trx_filters(options);
         my->config->enable_trim  = options.count("fill-trim");
         my->config->enable_check = options.count("frdb-check");
+        app().find_plugin<rocksdb_plugin>()->register_metrics(*app().find_plugin<fill_plugin>()->get_metrics()->registry);
     }
     FC_LOG_AND_RETHROW()
 }
@@ -0,0 +1,66 @@
+// copyright defined in LICENSE.txt
+
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+
+// Thread-safe map which evicts its least-recently used entries once their total size passes max_size.
+// Callers supply each entry's size in whatever unit max_size uses.
+template <typename Key, typename Value, typename Hash = std::hash<Key>>
+class lru_cache {
+  private:
+    struct entry {
+        Key    key;
+        Value  value;
+        size_t size;
+    };
+
+    std::mutex                                                         mutex;
+    size_t                                                             max_size;
+    size_t                                                             size    = 0;
+    std::list<entry>                                                   entries = {}; // most-recently used first
+    std::unordered_map<Key, typename std::list<entry>::iterator, Hash> index   = {};
+
+    void erase(typename std::list<entry>::iterator it) {
+        size -= it->size;
+        index.erase(it->key);
+        entries.erase(it);
+    }
+
+  public:
+    explicit lru_cache(size_t max_size)
+        : max_size(max_size) {}
+
+    std::optional<Value> get(const Key& key) {
+        std::lock_guard<std::mutex> lock{mutex};
+        auto                        it = index.find(key);
+        if (it == index.end())
+            return {};
+        entries.splice(entries.begin(), entries, it->second);
+        return it->second->value;
+    }
+
+    void put(const Key& key, Value value, size_t entry_size) {
+        if (entry_size > max_size)
+            return;
+        std::lock_guard<std::mutex> lock{mutex};
+        auto                        it = index.find(key);
+        if (it != index.end())
+            erase(it->second);
+        while (!entries.empty() && size + entry_size > max_size)
+            erase(std::prev(entries.end()));
+        entries.push_front(entry{key, std::move(value), entry_size});
+        index[key] = entries.begin();
+        size += entry_size;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock{mutex};
+        index.clear();
+        entries.clear();
+        size = 0;
+    }
+};
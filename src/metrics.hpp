@@ -0,0 +1,313 @@
+// copyright defined in LICENSE.txt
+
+#pragma once
+
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/version.hpp>
+#include <fc/log/logger.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Counters, gauges and histograms which render in the Prometheus text exposition format
+namespace metrics {
+
+using labels = std::vector<std::pair<std::string, std::string>>;
+
+struct metric {
+    virtual ~metric() {}
+
+    // Appends this metric's sample lines
+    virtual void render(std::string& out, const std::string& name, const labels& l) const = 0;
+};
+
+inline std::string format_labels(const labels& l, const char* extra_name = nullptr, const std::string& extra_value = {}) {
+    if (l.empty() && !extra_name)
+        return {};
+    std::string result = "{";
+    auto        append = [&](const std::string& name, const std::string& value) {
+        if (result.size() > 1)
+            result += ',';
+        result += name + "=\"";
+        for (auto ch : value) {
+            if (ch == '\\' || ch == '"')
+                result += '\\';
+            if (ch == '\n')
+                result += "\\n";
+            else
+                result += ch;
+        }
+        result += '"';
+    };
+    for (auto& [name, value] : l)
+        append(name, value);
+    if (extra_name)
+        append(extra_name, extra_value);
+    return result + "}";
+}
+
+inline std::string format_value(double value) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.15g", value);
+    return buf;
+}
+
+class counter : public metric {
+  private:
+    std::atomic<uint64_t> value = 0;
+
+  public:
+    void     add(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+    // For counters kept elsewhere and copied in when collected
+    void set(uint64_t n) { value.store(n, std::memory_order_relaxed); }
+
+    void render(std::string& out, const std::string& name, const labels& l) const override {
+        out += name + format_labels(l) + " " + std::to_string(get()) + "\n";
+    }
+};
+
+class gauge : public metric {
+  private:
+    std::atomic<int64_t> value = 0;
+
+  public:
+    void    set(int64_t n) { value.store(n, std::memory_order_relaxed); }
+    void    add(int64_t n) { value.fetch_add(n, std::memory_order_relaxed); }
+    int64_t get() const { return value.load(std::memory_order_relaxed); }
+
+    void render(std::string& out, const std::string& name, const labels& l) const override {
+        out += name + format_labels(l) + " " + std::to_string(get()) + "\n";
+    }
+};
+
+class histogram : public metric {
+  private:
+    std::vector<double>                      bounds;  // upper bounds, ascending; +Inf is implied
+    std::unique_ptr<std::atomic<uint64_t>[]> buckets; // not cumulative; one more than bounds for +Inf
+    std::atomic<uint64_t>                    count = 0;
+    std::atomic<double>                      sum   = 0;
+
+  public:
+    explicit histogram(std::vector<double> bounds)
+        : bounds(std::move(bounds))
+        , buckets(new std::atomic<uint64_t>[this->bounds.size() + 1]) {
+        for (size_t i = 0; i <= this->bounds.size(); ++i)
+            buckets[i] = 0;
+    }
+
+    void observe(double value) {
+        auto i = std::lower_bound(bounds.begin(), bounds.end(), value) - bounds.begin();
+        buckets[i].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        auto old = sum.load(std::memory_order_relaxed);
+        while (!sum.compare_exchange_weak(old, old + value, std::memory_order_relaxed))
+            ;
+    }
+
+    void render(std::string& out, const std::string& name, const labels& l) const override {
+        uint64_t total = 0;
+        for (size_t i = 0; i <= bounds.size(); ++i) {
+            total += buckets[i].load(std::memory_order_relaxed);
+            out += name + "_bucket" + format_labels(l, "le", i < bounds.size() ? format_value(bounds[i]) : "+Inf") + " " +
+                   std::to_string(total) + "\n";
+        }
+        out += name + "_sum" + format_labels(l) + " " + format_value(sum.load(std::memory_order_relaxed)) + "\n";
+        out += name + "_count" + format_labels(l) + " " + std::to_string(count.load(std::memory_order_relaxed)) + "\n";
+    }
+};
+
+// Bounds, in seconds, for request and I/O latencies
+inline std::vector<double> latency_bounds() {
+    return {0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+}
+
+// Powers of 4 from 1, for sizes and counts
+inline std::vector<double> size_bounds(int n = 12) {
+    std::vector<double> result;
+    for (double b = 1; n-- > 0; b *= 4)
+        result.push_back(b);
+    return result;
+}
+
+// A set of metrics. Metrics are created on first use and live as long as the registry, so callers may
+// hold on to the references.
+class registry {
+  private:
+    struct family {
+        std::string                                             help    = {};
+        const char*                                             type    = {};
+        std::vector<std::pair<labels, std::unique_ptr<metric>>> metrics = {};
+    };
+
+    std::mutex                         mutex      = {};
+    std::map<std::string, family>      families   = {};
+    std::vector<std::function<void()>> collectors = {};
+
+    template <typename T, typename... A>
+    T& get(const std::string& name, const std::string& help, const char* type, const labels& l, A&&... a) {
+        std::lock_guard<std::mutex> lock{mutex};
+        auto&                       f = families[name];
+        if (!f.type) {
+            f.help = help;
+            f.type = type;
+        } else if (strcmp(f.type, type)) {
+            throw std::runtime_error("metric " + name + " registered with two types");
+        }
+        for (auto& [existing, m] : f.metrics)
+            if (existing == l)
+                return static_cast<T&>(*m);
+        f.metrics.emplace_back(l, std::make_unique<T>(std::forward<A>(a)...));
+        return static_cast<T&>(*f.metrics.back().second);
+    }
+
+  public:
+    counter& get_counter(const std::string& name, const std::string& help, const labels& l = {}) {
+        return get<counter>(name, help, "counter", l);
+    }
+
+    gauge& get_gauge(const std::string& name, const std::string& help, const labels& l = {}) { return get<gauge>(name, help, "gauge", l); }
+
+    histogram& get_histogram(const std::string& name, const std::string& help, std::vector<double> bounds, const labels& l = {}) {
+        return get<histogram>(name, help, "histogram", l, std::move(bounds));
+    }
+
+    // f runs before each render; use it to sample values kept elsewhere into gauges and counters
+    void on_collect(std::function<void()> f) {
+        std::lock_guard<std::mutex> lock{mutex};
+        collectors.push_back(std::move(f));
+    }
+
+    std::string render() {
+        std::vector<std::function<void()>> fs;
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            fs = collectors;
+        }
+        for (auto& f : fs)
+            f();
+        std::string                 out;
+        std::lock_guard<std::mutex> lock{mutex};
+        for (auto& [name, f] : families) {
+            out += "# HELP " + name + " " + f.help + "\n";
+            out += "# TYPE " + name + " " + f.type + "\n";
+            for (auto& [l, m] : f.metrics)
+                m->render(out, name, l);
+        }
+        return out;
+    }
+};
+
+// Content-Type of render()'s output
+inline constexpr const char* content_type = "text/plain; version=0.0.4";
+
+// Serves a registry at GET /metrics, for processes which have no other HTTP server. Each connection gets
+// one response then closes. Reads and writes time out, and only a few connections may be open at once.
+class listener : public std::enable_shared_from_this<listener> {
+  private:
+    // Connections beyond this are closed as soon as they're accepted
+    static constexpr uint32_t max_sessions = 16;
+
+    struct session : std::enable_shared_from_this<session> {
+        boost::beast::tcp_stream                                      stream;
+        std::shared_ptr<listener>                                     owner;
+        boost::beast::flat_buffer                                     buffer = {};
+        boost::beast::http::request<boost::beast::http::empty_body>   req    = {};
+        boost::beast::http::response<boost::beast::http::string_body> res    = {};
+
+        session(boost::asio::ip::tcp::socket&& socket, const std::shared_ptr<listener>& owner)
+            : stream(std::move(socket))
+            , owner(owner) {
+            ++owner->num_sessions;
+        }
+
+        ~session() { --owner->num_sessions; }
+
+        void run() {
+            stream.expires_after(std::chrono::seconds(30));
+            boost::beast::http::async_read(stream, buffer, req, [self = shared_from_this()](boost::beast::error_code ec, size_t) {
+                if (ec)
+                    return;
+                self->respond();
+            });
+        }
+
+        void respond() {
+            namespace http = boost::beast::http;
+            res.version(req.version());
+            res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+            res.keep_alive(false);
+            if (req.method() == http::verb::get && req.target() == "/metrics") {
+                res.result(http::status::ok);
+                res.set(http::field::content_type, content_type);
+                res.body() = owner->reg->render();
+            } else {
+                res.result(http::status::not_found);
+                res.set(http::field::content_type, "text/plain");
+                res.body() = "not found\n";
+            }
+            res.prepare_payload();
+            stream.expires_after(std::chrono::seconds(30));
+            http::async_write(stream, res, [self = shared_from_this()](boost::beast::error_code, size_t) {
+                boost::beast::error_code ec;
+                self->stream.socket().shutdown(boost::asio::ip::tcp::socket::shutdown_send, ec);
+            });
+        }
+    };
+
+    boost::asio::ip::tcp::acceptor acceptor;
+    std::shared_ptr<registry>      reg;
+    std::atomic<uint32_t>          num_sessions = 0;
+
+    void do_accept() {
+        acceptor.async_accept([self = shared_from_this()](boost::beast::error_code ec, boost::asio::ip::tcp::socket socket) {
+            if (ec == boost::asio::error::operation_aborted)
+                return;
+            if (ec)
+                elog("metrics accept: ${m}", ("m", ec.message()));
+            else if (self->num_sessions < max_sessions)
+                std::make_shared<session>(std::move(socket), self)->run();
+            self->do_accept();
+        });
+    }
+
+  public:
+    // address is host:port
+    listener(boost::asio::io_context& ioc, const std::string& address, const std::shared_ptr<registry>& reg)
+        : acceptor(ioc)
+        , reg(reg) {
+        auto pos = address.find(':');
+        if (pos == std::string::npos)
+            throw std::runtime_error("invalid metrics address: " + address);
+        boost::asio::ip::tcp::endpoint endpoint{
+            boost::asio::ip::make_address(address.substr(0, pos)), (unsigned short)std::stoi(address.substr(pos + 1))};
+        acceptor.open(endpoint.protocol());
+        acceptor.set_option(boost::asio::socket_base::reuse_address(true));
+        acceptor.bind(endpoint);
+        acceptor.listen();
+    }
+
+    void start() {
+        ilog("metrics listening on ${a}", ("a", acceptor.local_endpoint().address().to_string() + ":" +
+                                                    std::to_string(acceptor.local_endpoint().port())));
+        do_accept();
+    }
+
+    void stop() {
+        boost::system::error_code ec;
+        acceptor.close(ec);
+    }
+};
+
+} // namespace metrics
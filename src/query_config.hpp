@@ -73,6 +73,7 @@ struct index {
     std::string                      table         = {};
     bool                             include_in_pg = {};
     bool                             only_for_trim = {};
+    bool                             covering      = {}; // rocksdb: entries hold a copy of the row
     std::vector<typename Defs::key>  sort_keys     = {};
     std::vector<typename Defs::type> range_types   = {};
     const typename Defs::table*      table_obj     = {};
@@ -85,6 +86,7 @@ constexpr void for_each_field(index<Defs>*, F f) {
     EOSIO_REFLECT_MEMBER(index<Defs>, table);
     EOSIO_REFLECT_MEMBER(index<Defs>, include_in_pg);
     EOSIO_REFLECT_MEMBER(index<Defs>, only_for_trim);
+    EOSIO_REFLECT_MEMBER(index<Defs>, covering);
     EOSIO_REFLECT_MEMBER(index<Defs>, sort_keys);
 };
 
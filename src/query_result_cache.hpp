@@ -0,0 +1,67 @@
+// copyright defined in LICENSE.txt
+
+#pragma once
+
+#include "lru_cache.hpp"
+#include "state_history.hpp"
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+// query_database results which can't change: the query reads delta tables as of an irreversible block.
+// Trimming history can still remove rows, so the cache empties whenever fill_status.first moves.
+class query_result_cache {
+  private:
+    std::mutex                                mutex      = {}; // protects first
+    uint32_t                                  first      = 0;
+    lru_cache<std::string, std::vector<char>> results;
+    std::atomic<uint64_t>                     num_hits   = 0;
+    std::atomic<uint64_t>                     num_misses = 0;
+
+    // Empties the cache if history was trimmed since the last call
+    void sync_first(const state_history::fill_status& fill_status) {
+        std::lock_guard<std::mutex> lock{mutex};
+        if (fill_status.first != first) {
+            first = fill_status.first;
+            results.clear();
+        }
+    }
+
+  public:
+    explicit query_result_cache(size_t max_bytes)
+        : results(max_bytes) {}
+
+    // True if the query only sees rows at or below its snapshot block
+    template <typename Query>
+    static bool is_snapshot_query(const Query& query) {
+        return query.has_block_snapshot && query.table_obj->is_delta && (!query.join_table || query.join_table->is_delta);
+    }
+
+    // Returns the cache key for a query, or nothing if its result may still change. query_bin is the
+    // whole serialized query; snapshot_block_num is the block it was clamped to.
+    template <typename Query>
+    static std::optional<std::string> key(
+        const Query& query, abieos::input_buffer query_bin, uint32_t snapshot_block_num, const state_history::fill_status& fill_status) {
+        if (!is_snapshot_query(query) || snapshot_block_num > fill_status.irreversible)
+            return {};
+        std::string result(query_bin.pos, query_bin.end);
+        result.append(reinterpret_cast<const char*>(&snapshot_block_num), sizeof(snapshot_block_num));
+        return result;
+    }
+
+    std::optional<std::vector<char>> get(const state_history::fill_status& fill_status, const std::string& key) {
+        sync_first(fill_status);
+        auto result = results.get(key);
+        (result ? num_hits : num_misses).fetch_add(1, std::memory_order_relaxed);
+        return result;
+    }
+
+    void put(const state_history::fill_status& fill_status, const std::string& key, const std::vector<char>& result) {
+        sync_first(fill_status);
+        results.put(key, result, 2 * key.size() + result.size() + 128);
+    }
+
+    uint64_t get_hits() const { return num_hits.load(std::memory_order_relaxed); }
+    uint64_t get_misses() const { return num_misses.load(std::memory_order_relaxed); }
+};
@@ -1,20 +1,139 @@
 // copyright defined in LICENSE.txt
 
 #include "rocksdb_plugin.hpp"
+#include "metrics.hpp"
 #include "util.hpp"
 
+#include <boost/asio/steady_timer.hpp>
 #include <fc/exception/exception.hpp>
 
 using namespace appbase;
 using namespace std::literals;
 
-struct rocksdb_plugin_impl {
+namespace {
+
+struct ticker_info {
+    uint32_t    ticker;
+    const char* name;
+    const char* help;
+};
+
+struct histogram_info {
+    uint32_t    histogram;
+    const char* name;
+    const char* help;
+};
+
+struct property_info {
+    const char* property;
+    const char* name;
+    const char* help;
+};
+
+const ticker_info tickers[] = {
+    {rocksdb::BLOCK_CACHE_HIT, "block_cache_hit", "Block cache hits"},
+    {rocksdb::BLOCK_CACHE_MISS, "block_cache_miss", "Block cache misses"},
+    {rocksdb::STALL_MICROS, "stall_micros", "Time writers waited for compaction or flush to catch up"},
+    {rocksdb::COMPACT_READ_BYTES, "compact_read_bytes", "Bytes read by compaction"},
+    {rocksdb::COMPACT_WRITE_BYTES, "compact_write_bytes", "Bytes written by compaction"},
+    {rocksdb::FLUSH_WRITE_BYTES, "flush_write_bytes", "Bytes written by memtable flushes"},
+    {rocksdb::BYTES_WRITTEN, "bytes_written", "Bytes written by Put, Delete and Write"},
+    {rocksdb::BYTES_READ, "bytes_read", "Bytes read by Get"},
+    {rocksdb::NUMBER_KEYS_WRITTEN, "keys_written", "Keys written by Put and Write"},
+};
+
+const histogram_info histograms[] = {
+    {rocksdb::DB_GET, "get_micros", "Get latency"},
+    {rocksdb::DB_WRITE, "write_micros", "Write latency"},
+    {rocksdb::DB_SEEK, "seek_micros", "Iterator seek latency"},
+    {rocksdb::COMPACTION_TIME, "compaction_micros", "Compaction job duration"},
+    {rocksdb::FLUSH_TIME, "flush_micros", "Memtable flush duration"},
+};
+
+const property_info properties[] = {
+    {"rocksdb.estimate-num-keys", "estimate_num_keys", "Estimated number of keys"},
+    {"rocksdb.cur-size-all-mem-tables", "mem_table_bytes", "Size of active and unflushed immutable memtables"},
+    {"rocksdb.num-immutable-mem-table", "immutable_mem_tables", "Immutable memtables waiting to flush"},
+    {"rocksdb.num-running-flushes", "running_flushes", "Memtable flushes in progress"},
+    {"rocksdb.num-running-compactions", "running_compactions", "Compactions in progress"},
+    {"rocksdb.estimate-pending-compaction-bytes", "pending_compaction_bytes", "Estimated bytes compaction needs to rewrite"},
+    {"rocksdb.block-cache-usage", "block_cache_bytes", "Memory used by the block cache"},
+    {"rocksdb.total-sst-files-size", "sst_files_bytes", "Size of all SST files"},
+    {"rocksdb.actual-delayed-write-rate", "delayed_write_rate", "Current delayed write rate in bytes per second; 0 if not delayed"},
+    {"rocksdb.is-write-stopped", "write_stopped", "1 if writes are stopped"},
+};
+
+uint64_t get_property(rocksdb_inst& inst, const char* property) {
+    uint64_t value = 0;
+    inst.database.db->GetIntProperty(property, &value);
+    return value;
+}
+
+} // namespace
+
+struct rocksdb_plugin_impl : std::enable_shared_from_this<rocksdb_plugin_impl> {
     boost::filesystem::path         config_path    = {};
     boost::filesystem::path         db_path        = {};
     std::optional<uint32_t>         threads        = {};
     std::optional<uint32_t>         max_open_files = {};
+    uint32_t                        stats_interval = 0; // seconds; 0 disables statistics
     std::shared_ptr<::rocksdb_inst> rocksdb_inst   = {};
     std::mutex                      mutex          = {};
+    boost::asio::steady_timer       stats_timer{app().get_io_service()};
+    std::vector<uint64_t>           last_tickers = {}; // as of the last log_stats()
+
+    std::shared_ptr<::rocksdb_inst> get_opened() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return rocksdb_inst;
+    }
+
+    void schedule_stats() {
+        stats_timer.expires_after(std::chrono::seconds(stats_interval));
+        stats_timer.async_wait([self = shared_from_this()](const boost::system::error_code& ec) {
+            if (ec)
+                return;
+            self->log_stats();
+            self->schedule_stats();
+        });
+    }
+
+    // Logs ticker deltas since the last call, latency percentiles since startup, and current properties
+    void log_stats() {
+        auto inst = get_opened();
+        if (!inst || !inst->database.stats)
+            return;
+        auto&                 stats = *inst->database.stats;
+        std::vector<uint64_t> current;
+        for (auto& t : tickers)
+            current.push_back(stats.getTickerCount(t.ticker));
+        last_tickers.resize(current.size());
+        auto delta = [&](uint32_t ticker) {
+            for (size_t i = 0; i < current.size(); ++i)
+                if (tickers[i].ticker == ticker)
+                    return current[i] - last_tickers[i];
+            return uint64_t(0);
+        };
+        auto hits   = delta(rocksdb::BLOCK_CACHE_HIT);
+        auto misses = delta(rocksdb::BLOCK_CACHE_MISS);
+        ilog("rocksdb in the last ${i}s: block_cache_hit_rate=${rate} stall_us=${stall} compact_read_bytes=${cr} "
+             "compact_write_bytes=${cw} flush_bytes=${fb} bytes_written=${bw} bytes_read=${br}",
+             ("i", stats_interval)("rate", hits + misses ? double(hits) / (hits + misses) : 0.0)("stall", delta(rocksdb::STALL_MICROS))(
+                 "cr", delta(rocksdb::COMPACT_READ_BYTES))("cw", delta(rocksdb::COMPACT_WRITE_BYTES))(
+                 "fb", delta(rocksdb::FLUSH_WRITE_BYTES))("bw", delta(rocksdb::BYTES_WRITTEN))("br", delta(rocksdb::BYTES_READ)));
+        last_tickers = std::move(current);
+        for (auto& h : histograms) {
+            rocksdb::HistogramData data;
+            stats.histogramData(h.histogram, &data);
+            if (data.count)
+                ilog("  ${n}: count=${c} p50=${p50} p95=${p95} p99=${p99} max=${max}",
+                     ("n", h.name)("c", data.count)("p50", data.median)("p95", data.percentile95)("p99", data.percentile99)(
+                         "max", data.max));
+        }
+        std::string props;
+        for (auto& p : properties)
+            props += (props.empty() ? "" : " ") + std::string(p.name) + "=" + std::to_string(get_property(*inst, p.property));
+        ilog("  ${p}", ("p", props));
+    }
 };
 
 static abstract_plugin& _rocksdb_plugin = app().register_plugin<rocksdb_plugin>();
@@ -33,6 +152,9 @@ void rocksdb_plugin::set_program_options(options_description& cli, options_descr
     op("rdb-max-files", bpo::value<uint32_t>(),
        "RocksDB limit max number of open files (default unlimited). This should be smaller than 'ulimit -n #'. "
        "# should be a very large number for full-history nodes.");
+    op("rdb-stats", bpo::value<uint32_t>()->default_value(0),
+       "Enable RocksDB statistics and log them this often, in seconds. They are also published to the filler's or "
+       "wasm-ql's metrics endpoint when that is enabled. 0 disables.");
 }
 
 void rocksdb_plugin::plugin_initialize(const variables_map& options) {
@@ -43,13 +165,17 @@ void rocksdb_plugin::plugin_initialize(const variables_map& options) {
             my->threads = options["rdb-threads"].as<uint32_t>();
         if (!options["rdb-max-files"].empty())
             my->max_open_files = options["rdb-max-files"].as<uint32_t>();
+        my->stats_interval = options["rdb-stats"].as<uint32_t>();
     }
     FC_LOG_AND_RETHROW()
 }
 
-void rocksdb_plugin::plugin_startup() {}
+void rocksdb_plugin::plugin_startup() {
+    if (my->stats_interval)
+        my->schedule_stats();
+}
 
-void rocksdb_plugin::plugin_shutdown() {}
+void rocksdb_plugin::plugin_shutdown() { my->stats_timer.cancel(); }
 
 static void open_query_config(rocksdb_plugin_impl* my, std::shared_ptr<rocksdb_inst>& inst) {
     try {
@@ -67,8 +193,57 @@ static void open_query_config(rocksdb_plugin_impl* my, std::shared_ptr<rocksdb_i
 std::shared_ptr<rocksdb_inst> rocksdb_plugin::get_rocksdb_inst(bool fast_reads) {
     std::lock_guard<std::mutex> lock(my->mutex);
     if (!my->rocksdb_inst) {
-        my->rocksdb_inst = std::make_shared<rocksdb_inst>(my->db_path.c_str(), my->threads, my->max_open_files, fast_reads);
+        my->rocksdb_inst =
+            std::make_shared<rocksdb_inst>(my->db_path.c_str(), my->threads, my->max_open_files, fast_reads, my->stats_interval > 0);
         open_query_config(my.get(), my->rocksdb_inst);
     }
     return my->rocksdb_inst;
 }
+
+void rocksdb_plugin::register_metrics(metrics::registry& registry) {
+    if (!my->stats_interval)
+        return;
+    std::vector<metrics::counter*> ticker_counters;
+    for (auto& t : tickers)
+        ticker_counters.push_back(&registry.get_counter("rocksdb_"s + t.name + "_total", t.help));
+
+    struct histogram_metrics {
+        metrics::gauge*   p50;
+        metrics::gauge*   p95;
+        metrics::gauge*   p99;
+        metrics::counter* count;
+    };
+    std::vector<histogram_metrics> histogram_gauges;
+    for (auto& h : histograms) {
+        auto name = "rocksdb_"s + h.name;
+        histogram_gauges.push_back({
+            &registry.get_gauge(name, h.help + " percentiles since startup"s, {{"quantile", "0.5"}}),
+            &registry.get_gauge(name, h.help + " percentiles since startup"s, {{"quantile", "0.95"}}),
+            &registry.get_gauge(name, h.help + " percentiles since startup"s, {{"quantile", "0.99"}}),
+            &registry.get_counter(name + "_count", h.help + " samples"s),
+        });
+    }
+
+    std::vector<metrics::gauge*> property_gauges;
+    for (auto& p : properties)
+        property_gauges.push_back(&registry.get_gauge("rocksdb_"s + p.name, p.help));
+
+    registry.on_collect([my = my, ticker_counters, histogram_gauges, property_gauges] {
+        auto inst = my->get_opened();
+        if (!inst || !inst->database.stats)
+            return;
+        auto& stats = *inst->database.stats;
+        for (size_t i = 0; i < ticker_counters.size(); ++i)
+            ticker_counters[i]->set(stats.getTickerCount(tickers[i].ticker));
+        for (size_t i = 0; i < histogram_gauges.size(); ++i) {
+            rocksdb::HistogramData data;
+            stats.histogramData(histograms[i].histogram, &data);
+            histogram_gauges[i].p50->set(data.median);
+            histogram_gauges[i].p95->set(data.percentile95);
+            histogram_gauges[i].p99->set(data.percentile99);
+            histogram_gauges[i].count->set(data.count);
+        }
+        for (size_t i = 0; i < property_gauges.size(); ++i)
+            property_gauges[i]->set(get_property(*inst, properties[i].property));
+    });
+}
@@ -6,12 +6,20 @@
 #include "query_config_plugin.hpp"
 #include "state_history_rocksdb.hpp"
 
+#include <atomic>
+
+namespace metrics {
+class registry;
+}
+
 struct rocksdb_inst {
     state_history::rdb::database                     database;
     std::unique_ptr<const state_history::kv::config> query_config{};
+    std::atomic<uint64_t>                            fork_generation{}; // bumped by fill_rocksdb_plugin before it truncates
 
-    rocksdb_inst(const char* db_path, std::optional<uint32_t> threads, std::optional<uint32_t> max_open_files, bool fast_reads)
-        : database{db_path, threads, max_open_files, fast_reads} {}
+    rocksdb_inst(
+        const char* db_path, std::optional<uint32_t> threads, std::optional<uint32_t> max_open_files, bool fast_reads, bool statistics)
+        : database{db_path, threads, max_open_files, fast_reads, statistics} {}
 };
 
 class rocksdb_plugin : public appbase::plugin<rocksdb_plugin> {
@@ -28,6 +36,10 @@ class rocksdb_plugin : public appbase::plugin<rocksdb_plugin> {
 
     std::shared_ptr<rocksdb_inst> get_rocksdb_inst(bool fast_reads);
 
+    // Samples RocksDB statistics and properties into registry each time it renders. Does nothing unless
+    // --rdb-stats is set.
+    void register_metrics(metrics::registry& registry);
+
   private:
     std::shared_ptr<struct rocksdb_plugin_impl> my;
 };
@@ -6,6 +6,7 @@
 #include <boost/filesystem.hpp>
 #include <fc/exception/exception.hpp>
 #include <rocksdb/db.h>
+#include <rocksdb/statistics.h>
 
 namespace state_history {
 namespace rdb {
@@ -24,12 +25,15 @@ struct database {
     std::shared_ptr<rocksdb::Statistics> stats;
     std::unique_ptr<rocksdb::DB>         db;
 
-    database(const char* db_path, std::optional<uint32_t> threads, std::optional<uint32_t> max_open_files, bool fast_reads) {
+    database(
+        const char* db_path, std::optional<uint32_t> threads, std::optional<uint32_t> max_open_files, bool fast_reads,
+        bool statistics = false) {
         rocksdb::DB*     p;
         rocksdb::Options options;
-        // stats = options.statistics = rocksdb::CreateDBStatistics();
-        // stats->set_stats_level(rocksdb::kExceptTimeForMutex);
-        // options.stats_dump_period_sec = 2;
+        if (statistics) {
+            stats = options.statistics = rocksdb::CreateDBStatistics();
+            stats->set_stats_level(rocksdb::kExceptTimeForMutex);
+        }
         options.create_if_missing = true;
 
         options.level_compaction_dynamic_level_bytes = true;
@@ -3,6 +3,7 @@
 #include <eosio/stream.hpp>
 
 #include <boost/iostreams/device/back_inserter.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
 #include <boost/iostreams/filter/zlib.hpp>
 #include <boost/iostreams/filtering_stream.hpp>
 #include <fstream>
@@ -30,3 +31,24 @@ inline std::vector<char> zlib_decompress(eosio::input_stream data) {
     boost::iostreams::close(decomp);
     return out;
 }
+
+// zlib format; HTTP calls this "deflate"
+inline std::vector<char> zlib_compress(eosio::input_stream data, int level) {
+    std::vector<char>                   out;
+    boost::iostreams::filtering_ostream comp;
+    comp.push(boost::iostreams::zlib_compressor(boost::iostreams::zlib_params(level)));
+    comp.push(boost::iostreams::back_inserter(out));
+    boost::iostreams::write(comp, data.pos, data.end - data.pos);
+    boost::iostreams::close(comp);
+    return out;
+}
+
+inline std::vector<char> gzip_compress(eosio::input_stream data, int level) {
+    std::vector<char>                   out;
+    boost::iostreams::filtering_ostream comp;
+    comp.push(boost::iostreams::gzip_compressor(boost::iostreams::gzip_params(level)));
+    comp.push(boost::iostreams::back_inserter(out));
+    boost::iostreams::write(comp, data.pos, data.end - data.pos);
+    boost::iostreams::close(comp);
+    return out;
+}
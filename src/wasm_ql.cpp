@@ -5,17 +5,52 @@
 #include <fc/log/logger.hpp>
 #include <fc/scoped_exit.hpp>
 
+#include <boost/filesystem.hpp>
+
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
 using namespace abieos::literals;
 
 namespace wasm_ql {
 
 struct callbacks;
-using backend_t = eosio::vm::backend<callbacks>;
+template <typename Impl>
+using backend_t = eosio::vm::backend<callbacks, Impl>;
 using rhf_t     = eosio::vm::registered_host_functions<callbacks>;
 
+// Limits how many cursors one query may have open at once
+static constexpr size_t max_open_cursors = 64;
+
+// A module parsed for a particular vm_type. Hides the backend's type from the host callbacks.
+struct module_instance {
+    std::shared_ptr<const wasm_module> module;
+
+    module_instance(const std::shared_ptr<const wasm_module>& module)
+        : module(module) {}
+
+    virtual ~module_instance() {}
+
+    // Call function cb_alloc in the wasm's function table. Returns the offset of the allocated memory.
+    virtual uint32_t call_alloc(callbacks& cb, uint32_t cb_alloc_data, uint32_t cb_alloc, uint32_t size) = 0;
+
+    virtual void run(callbacks& cb) = 0;
+};
+
+// Adds the time until the returned object is destroyed to total
+static auto trace_phase(std::chrono::steady_clock::duration& total) {
+    return fc::make_scoped_exit([&total, start = std::chrono::steady_clock::now()] { total += std::chrono::steady_clock::now() - start; });
+}
+
 struct callbacks {
     wasm_ql::thread_state& thread_state;
-    backend_t&             backend;
+    module_instance&       instance;
 
     void check_bounds(const char* begin, const char* end) {
         if (begin > end)
@@ -25,15 +60,17 @@ struct callbacks {
 
     char* alloc(uint32_t cb_alloc_data, uint32_t cb_alloc, uint32_t size) {
         // todo: verify cb_alloc isn't in imports
-        auto result = backend.get_context().execute_func_table(
-            this, eosio::vm::interpret_visitor(backend.get_context()), cb_alloc, cb_alloc_data, size);
-        if (!result || !result->is_a<eosio::vm::i32_const_t>())
-            throw std::runtime_error("cb_alloc returned incorrect type");
-        char* begin = thread_state.wa.get_base_ptr<char>() + result->to_ui32();
+        char* begin = thread_state.wa.get_base_ptr<char>() + instance.call_alloc(*this, cb_alloc_data, cb_alloc, size);
         check_bounds(begin, begin + size);
         return begin;
     }
 
+    // Copies data into memory from the WASM's allocator
+    void copy_out(uint32_t cb_alloc_data, uint32_t cb_alloc, const char* data, size_t size) {
+        auto timer = trace_phase(thread_state.trace.alloc);
+        memcpy(alloc(cb_alloc_data, cb_alloc, size), data, size);
+    }
+
     void abort() { throw std::runtime_error("called abort"); }
 
     void eosio_assert_message(bool test, const char* msg, size_t msg_len) {
@@ -43,25 +80,121 @@ struct callbacks {
     }
 
     void get_database_status(uint32_t cb_alloc_data, uint32_t cb_alloc) {
-        auto data = alloc(cb_alloc_data, cb_alloc, thread_state.database_status.size());
-        memcpy(data, thread_state.database_status.data(), thread_state.database_status.size());
+        // The reply may now mention the head block
+        thread_state.query_session->used_head_block(thread_state.fill_status.head);
+        copy_out(cb_alloc_data, cb_alloc, thread_state.database_status.data(), thread_state.database_status.size());
     }
 
     void get_input_data(uint32_t cb_alloc_data, uint32_t cb_alloc) {
-        auto data = alloc(cb_alloc_data, cb_alloc, thread_state.request.end - thread_state.request.pos);
-        memcpy(data, thread_state.request.pos, thread_state.request.end - thread_state.request.pos);
+        copy_out(cb_alloc_data, cb_alloc, thread_state.request.pos, thread_state.request.end - thread_state.request.pos);
     }
 
     void set_output_data(const char* begin, const char* end) {
         check_bounds(begin, end);
+        if (thread_state.stream && thread_state.stream->started())
+            throw std::runtime_error("set_output_data called after append_output_data streamed part of the output");
         thread_state.reply.assign(begin, end);
     }
 
+    // Adds to the output. Once enough collects, it's sent to the client while the query keeps running.
+    void append_output_data(const char* begin, const char* end) {
+        check_bounds(begin, end);
+        thread_state.reply.insert(thread_state.reply.end(), begin, end);
+        if (thread_state.stream && thread_state.reply.size() >= thread_state.stream->chunk_size()) {
+            thread_state.trace.bytes_streamed += thread_state.reply.size();
+            thread_state.stream->write(std::move(thread_state.reply), thread_state.deadline);
+            thread_state.reply.clear();
+        }
+    }
+
+    // Charges the rows scanned since scanned_before to the request, then fails it once it has scanned more than
+    // shared_state::max_rows. Fork retries and sub-requests running in parallel share one budget.
+    void check_row_budget(uint64_t scanned_before) {
+        auto max_rows = thread_state.shared->max_rows;
+        if (!max_rows)
+            return;
+        if ((*thread_state.rows_used += thread_state.query_session->rows_scanned - scanned_before) > max_rows)
+            throw query_error(503, "query scanned more than " + std::to_string(max_rows) + " rows");
+    }
+
     void query_database(const char* req_begin, const char* req_end, uint32_t cb_alloc_data, uint32_t cb_alloc) {
         check_bounds(req_begin, req_end);
-        auto result = thread_state.query_session->query_database({req_begin, req_end}, thread_state.fill_status.head);
-        auto data   = alloc(cb_alloc_data, cb_alloc, result.size());
-        memcpy(data, result.data(), result.size());
+        auto              scanned = thread_state.query_session->rows_scanned;
+        std::vector<char> result;
+        {
+            auto timer = trace_phase(thread_state.trace.database);
+            result     = thread_state.query_session->query_database({req_begin, req_end}, thread_state.fill_status);
+        }
+        check_row_budget(scanned);
+        copy_out(cb_alloc_data, cb_alloc, result.data(), result.size());
+    }
+
+    // Request: varuint32 count, then each query as a varuint32 size followed by the serialized query.
+    // Result: varuint32 count, then each query's result as a varuint32 size followed by the result.
+    void query_database_batch(const char* req_begin, const char* req_end, uint32_t cb_alloc_data, uint32_t cb_alloc) {
+        check_bounds(req_begin, req_end);
+        abieos::input_buffer bin{req_begin, req_end};
+        auto                 count = abieos::bin_to_native<abieos::varuint32>(bin).value;
+        if (count > bin.end - bin.pos)
+            throw std::runtime_error("query_database_batch: request is truncated");
+        std::vector<abieos::input_buffer> queries(count);
+        for (auto& query : queries) {
+            auto size = abieos::bin_to_native<abieos::varuint32>(bin).value;
+            if (size > bin.end - bin.pos)
+                throw std::runtime_error("query_database_batch: request is truncated");
+            query = {bin.pos, bin.pos + size};
+            bin.pos += size;
+        }
+        auto              scanned = thread_state.query_session->rows_scanned;
+        std::vector<char> result;
+        {
+            auto timer = trace_phase(thread_state.trace.database);
+            result     = abieos::native_to_bin(thread_state.query_session->query_database_batch(queries, thread_state.fill_status));
+        }
+        check_row_budget(scanned);
+        if ((uint32_t)result.size() != result.size())
+            throw std::runtime_error("query_database_batch: result is too big");
+        copy_out(cb_alloc_data, cb_alloc, result.data(), result.size());
+    }
+
+    uint32_t query_open(const char* req_begin, const char* req_end) {
+        check_bounds(req_begin, req_end);
+        auto  timer   = trace_phase(thread_state.trace.database);
+        auto  cursor  = thread_state.query_session->open_cursor({req_begin, req_end}, thread_state.fill_status);
+        auto& cursors = thread_state.cursors;
+        auto  it      = std::find(cursors.begin(), cursors.end(), nullptr);
+        if (it != cursors.end()) {
+            *it = std::move(cursor);
+            return it - cursors.begin() + 1;
+        }
+        if (cursors.size() >= max_open_cursors)
+            throw std::runtime_error("query_open: too many open cursors");
+        cursors.push_back(std::move(cursor));
+        return cursors.size();
+    }
+
+    query_cursor& get_cursor(uint32_t cursor) {
+        if (!cursor || cursor > thread_state.cursors.size() || !thread_state.cursors[cursor - 1])
+            throw std::runtime_error("invalid cursor");
+        return *thread_state.cursors[cursor - 1];
+    }
+
+    void query_next_batch(uint32_t cursor, uint32_t max_rows, uint32_t cb_alloc_data, uint32_t cb_alloc) {
+        if (!max_rows)
+            throw std::runtime_error("query_next_batch: max_rows is 0");
+        auto              scanned = thread_state.query_session->rows_scanned;
+        std::vector<char> result;
+        {
+            auto timer = trace_phase(thread_state.trace.database);
+            result     = get_cursor(cursor).next_batch(max_rows);
+        }
+        check_row_budget(scanned);
+        copy_out(cb_alloc_data, cb_alloc, result.data(), result.size());
+    }
+
+    void query_close(uint32_t cursor) {
+        get_cursor(cursor);
+        thread_state.cursors[cursor - 1].reset();
     }
 
     void print_range(const char* begin, const char* end) {
@@ -77,10 +210,323 @@ void register_callbacks() {
     rhf_t::add<callbacks, &callbacks::get_database_status, eosio::vm::wasm_allocator>("env", "get_database_status");
     rhf_t::add<callbacks, &callbacks::get_input_data, eosio::vm::wasm_allocator>("env", "get_input_data");
     rhf_t::add<callbacks, &callbacks::set_output_data, eosio::vm::wasm_allocator>("env", "set_output_data");
+    rhf_t::add<callbacks, &callbacks::append_output_data, eosio::vm::wasm_allocator>("env", "append_output_data");
     rhf_t::add<callbacks, &callbacks::query_database, eosio::vm::wasm_allocator>("env", "query_database");
+    rhf_t::add<callbacks, &callbacks::query_database_batch, eosio::vm::wasm_allocator>("env", "query_database_batch");
+    rhf_t::add<callbacks, &callbacks::query_open, eosio::vm::wasm_allocator>("env", "query_open");
+    rhf_t::add<callbacks, &callbacks::query_next_batch, eosio::vm::wasm_allocator>("env", "query_next_batch");
+    rhf_t::add<callbacks, &callbacks::query_close, eosio::vm::wasm_allocator>("env", "query_close");
     rhf_t::add<callbacks, &callbacks::print_range, eosio::vm::wasm_allocator>("env", "print_range");
 }
 
+// Linear memory image captured after a module's initialize export has run. On Linux the image lives in a
+// memfd and restore() maps it copy-on-write over linear memory, so only pages a query touches get copied.
+class memory_snapshot {
+  private:
+    uint32_t          pages = 0;
+    int               fd    = -1;
+    std::vector<char> data  = {};
+
+    size_t size() const { return size_t(pages) * eosio::vm::page_size; }
+
+  public:
+    memory_snapshot(eosio::vm::wasm_allocator& wa) {
+        pages      = std::max(wa.get_current_page(), 0);
+        auto* base = wa.get_base_ptr<char>();
+#ifdef __linux__
+        fd = memfd_create("wasm-ql-snapshot", MFD_CLOEXEC);
+        if (fd >= 0) {
+            size_t pos = 0;
+            while (pos < size()) {
+                auto n = pwrite(fd, base + pos, size() - pos, pos);
+                if (n <= 0)
+                    break;
+                pos += n;
+            }
+            if (pos == size())
+                return;
+            close(fd);
+            fd = -1;
+        }
+#endif
+        data.assign(base, base + size());
+    }
+
+    memory_snapshot(const memory_snapshot&) = delete;
+    memory_snapshot& operator=(const memory_snapshot&) = delete;
+
+    ~memory_snapshot() {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    void restore(eosio::vm::wasm_allocator& wa) {
+        if (wa.get_current_page() != (int32_t)pages)
+            wa.reset(pages);
+        if (!pages)
+            return;
+        auto* base = wa.get_base_ptr<char>();
+        if (fd >= 0) {
+            if (mmap(base, size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+                throw std::runtime_error("unable to restore memory snapshot");
+        } else {
+            memcpy(base, data.data(), size());
+        }
+    }
+};
+
+template <typename Impl>
+struct module_instance_impl : module_instance {
+    backend_t<Impl>                  backend;
+    std::unique_ptr<memory_snapshot> snapshot;
+
+    // The parser doesn't modify code; module keeps it alive for as long as the backend exists
+    module_instance_impl(const std::shared_ptr<const wasm_module>& module)
+        : module_instance(module)
+        , backend(const_cast<eosio::vm::wasm_code&>(module->code)) {
+        rhf_t::resolve(backend.get_module());
+    }
+
+    virtual ~module_instance_impl() {}
+
+    auto get_visitor() {
+        if constexpr (std::is_same_v<Impl, eosio::vm::jit>)
+            return eosio::vm::jit_visitor(backend.get_context());
+        else
+            return eosio::vm::interpret_visitor(backend.get_context());
+    }
+
+    virtual uint32_t call_alloc(callbacks& cb, uint32_t cb_alloc_data, uint32_t cb_alloc, uint32_t size) override {
+        auto result = backend.get_context().execute_func_table(&cb, get_visitor(), cb_alloc, cb_alloc_data, size);
+        if (!result || !result->template is_a<eosio::vm::i32_const_t>())
+            throw std::runtime_error("cb_alloc returned incorrect type");
+        return result->to_ui32();
+    }
+
+    // Instances in the same thread share thread_state::wa. The first run initializes normally and snapshots
+    // the result; later runs restore the snapshot instead of repeating data segment setup, static
+    // constructors, and the initialize export. This relies on run_query returning the module's mutable
+    // globals (the stack pointer) to their prior values, which holds for every normal return. An instance
+    // which throws is discarded by run_query().
+    //
+    // When the request has a deadline, eos-vm's watchdog interrupts the WASM once it passes. Host callbacks
+    // aren't interrupted; they check the deadline themselves.
+    virtual void run(callbacks& cb) override {
+        auto& wa  = cb.thread_state.wa;
+        auto  run = [&] {
+            backend.set_wasm_allocator(&wa);
+            if (snapshot) {
+                snapshot->restore(wa);
+            } else {
+                backend.initialize(&cb);
+                backend(&cb, "env", "initialize");
+                snapshot = std::make_unique<memory_snapshot>(wa);
+            }
+            backend(&cb, "env", "run_query");
+        };
+        auto deadline = cb.thread_state.deadline;
+        if (deadline == std::chrono::steady_clock::time_point::max())
+            return run();
+        auto left = deadline - std::chrono::steady_clock::now();
+        if (left <= std::chrono::steady_clock::duration::zero())
+            throw query_error(504, "query timed out");
+        try {
+            backend.timed_run(eosio::vm::watchdog{left}, run);
+        } catch (eosio::vm::timeout_exception&) {
+            throw query_error(504, "query timed out");
+        }
+    }
+};
+
+static std::shared_ptr<module_instance> create_instance(vm_type vm, const std::shared_ptr<const wasm_module>& module) {
+    switch (vm) {
+    case vm_type::interpreter: return std::make_shared<module_instance_impl<eosio::vm::interpreter>>(module);
+#ifdef __x86_64__
+    case vm_type::jit: return std::make_shared<module_instance_impl<eosio::vm::jit>>(module);
+#endif
+    default: throw std::runtime_error("unsupported vm type");
+    }
+}
+
+static std::optional<file_identity> get_file_identity(const std::string& filename) {
+    struct stat st;
+    if (stat(filename.c_str(), &st))
+        return {};
+#ifdef __APPLE__
+    auto& mtime = st.st_mtimespec;
+#else
+    auto& mtime = st.st_mtim;
+#endif
+    return file_identity{
+        .device     = (uint64_t)st.st_dev,
+        .inode      = (uint64_t)st.st_ino,
+        .mtime_sec  = (int64_t)mtime.tv_sec,
+        .mtime_nsec = (int64_t)mtime.tv_nsec,
+        .size       = (uint64_t)st.st_size,
+    };
+}
+
+static std::shared_ptr<const wasm_module> read_module(abieos::name short_name, const std::string& filename, bool validate) {
+    auto identity = get_file_identity(filename);
+    if (!identity)
+        throw std::runtime_error("can not stat " + filename);
+    auto module        = std::make_shared<wasm_module>();
+    module->short_name = short_name;
+    module->identity   = *identity;
+    module->code       = backend_t<eosio::vm::interpreter>::read_wasm(filename);
+    module->hash       = std::hash<std::string_view>{}(std::string_view{(const char*)module->code.data(), module->code.size()});
+    if (validate)
+        module_instance_impl<eosio::vm::interpreter> parsed{module};
+    return module;
+}
+
+// Returns the short name of a query wasm's file name, if any
+static std::optional<abieos::name> parse_module_filename(const std::string& filename) {
+    static const std::string suffix = "-server.wasm";
+    if (filename.size() <= suffix.size() || filename.compare(filename.size() - suffix.size(), suffix.size(), suffix))
+        return {};
+    auto         base = filename.substr(0, filename.size() - suffix.size());
+    abieos::name short_name{base.c_str()};
+    if ((std::string)short_name != base)
+        return {};
+    return short_name;
+}
+
+module_cache::~module_cache() { stop_watching(); }
+
+void module_cache::set(abieos::name short_name, const std::shared_ptr<const wasm_module>& module) {
+    std::lock_guard<std::mutex> lock{mutex};
+    auto                        updated = std::make_shared<module_map>(*modules);
+    if (module)
+        (*updated)[short_name] = module;
+    else
+        updated->erase(short_name);
+    std::atomic_store(&modules, std::shared_ptr<const module_map>{std::move(updated)});
+    ++version;
+}
+
+void module_cache::load(abieos::name short_name, bool validate) {
+    try {
+        set(short_name, read_module(short_name, filename(short_name), validate));
+        ilog("loaded ${f}", ("f", filename(short_name)));
+    } catch (const std::exception& e) {
+        elog("unable to load ${f}: ${e}", ("f", filename(short_name))("e", e.what()));
+    }
+}
+
+void module_cache::scan() {
+    boost::system::error_code ec;
+    for (boost::filesystem::directory_iterator it{wasm_dir, ec}, end; !ec && it != end; it.increment(ec))
+        if (auto short_name = parse_module_filename(it->path().filename().string()))
+            load(*short_name, true);
+    if (ec)
+        elog("unable to scan ${d}: ${e}", ("d", wasm_dir)("e", ec.message()));
+}
+
+void module_cache::start_watching() {
+#ifdef __linux__
+    int inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0 || inotify_add_watch(inotify_fd, wasm_dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE) < 0 ||
+        pipe(stop_pipe)) {
+        elog("unable to watch ${d}; will check WASM files on each request", ("d", wasm_dir));
+        if (inotify_fd >= 0)
+            close(inotify_fd);
+        return;
+    }
+
+    // Watch before scanning so changes made during the scan aren't missed
+    scan();
+    watching = true;
+    watcher  = std::thread([this, inotify_fd] { watch(inotify_fd); });
+#else
+    ilog("watching ${d} is not supported on this platform; will check WASM files on each request", ("d", wasm_dir));
+#endif
+}
+
+void module_cache::stop_watching() {
+    if (!watcher.joinable())
+        return;
+    char c = 0;
+    if (write(stop_pipe[1], &c, 1) != 1)
+        elog("unable to stop wasm directory watcher");
+    watcher.join();
+    watching = false;
+    close(stop_pipe[0]);
+    close(stop_pipe[1]);
+    stop_pipe[0] = stop_pipe[1] = -1;
+}
+
+void module_cache::watch(int inotify_fd) {
+#ifdef __linux__
+    alignas(inotify_event) char buf[4096];
+    pollfd                      fds[2] = {{inotify_fd, POLLIN, 0}, {stop_pipe[0], POLLIN, 0}};
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            elog("wasm directory watcher: poll failed");
+            break;
+        }
+        if (fds[1].revents)
+            break;
+        auto len = read(inotify_fd, buf, sizeof(buf));
+        if (len <= 0)
+            continue;
+        for (char* p = buf; p < buf + len;) {
+            auto* event = reinterpret_cast<inotify_event*>(p);
+            p += sizeof(inotify_event) + event->len;
+            if (event->mask & IN_Q_OVERFLOW) {
+                ilog("wasm directory watcher: events lost; rescanning ${d}", ("d", wasm_dir));
+                scan();
+                continue;
+            }
+            if (!event->len)
+                continue;
+            auto short_name = parse_module_filename(event->name);
+            if (!short_name)
+                continue;
+            if (event->mask & (IN_MOVED_FROM | IN_DELETE)) {
+                ilog("removed ${f}", ("f", filename(*short_name)));
+                set(*short_name, nullptr);
+            } else {
+                load(*short_name, true);
+            }
+        }
+    }
+    close(inotify_fd);
+#endif
+}
+
+std::shared_ptr<const wasm_module> module_cache::get(abieos::name short_name) {
+    auto current = std::atomic_load(&modules);
+    auto it      = current->find(short_name);
+    if (watching) {
+        if (it == current->end())
+            throw std::runtime_error("unknown query: " + (std::string)short_name);
+        return it->second;
+    }
+
+    auto identity = get_file_identity(filename(short_name));
+    if (!identity)
+        throw std::runtime_error("can not stat " + filename(short_name));
+    if (it != current->end() && it->second->identity == *identity)
+        return it->second;
+
+    // Another thread may load the same file concurrently; the last one to finish wins, which is harmless
+    auto module = read_module(short_name, filename(short_name), false);
+    ilog("loaded ${f}", ("f", filename(short_name)));
+    set(short_name, module);
+    return module;
+}
+
+static module_instance& get_instance(wasm_ql::thread_state& thread_state, abieos::name short_name) {
+    auto  module   = thread_state.shared->modules->get(short_name);
+    auto& instance = thread_state.instances[short_name];
+    if (!instance || (instance->module != module && (instance->module->hash != module->hash || instance->module->code != module->code)))
+        instance = create_instance(thread_state.shared->vm, module);
+    return *instance;
+}
+
 static void fill_context_data(wasm_ql::thread_state& thread_state) {
     thread_state.database_status.clear();
     abieos::native_to_bin(thread_state.fill_status.head, thread_state.database_status);
@@ -92,13 +538,8 @@ static void fill_context_data(wasm_ql::thread_state& thread_state) {
 
 // todo: detect thread_state.fill_status.first changing (history trim)
 static bool did_fork(wasm_ql::thread_state& thread_state) {
-    auto id = thread_state.query_session->get_block_id(thread_state.fill_status.head);
-    if (!id) {
-        ilog("fork detected (prev head not found)");
-        return true;
-    }
-    if (id->value != thread_state.fill_status.head_id.value) {
-        ilog("fork detected (head_id changed)");
+    if (thread_state.shared->fill_status->get()->fork_generation != thread_state.fork_generation) {
+        ilog("fork detected");
         return true;
     }
     return false;
@@ -107,54 +548,227 @@ static bool did_fork(wasm_ql::thread_state& thread_state) {
 template <typename F>
 static void retry_loop(wasm_ql::thread_state& thread_state, F f) {
     int num_tries = 0;
+    if (thread_state.shared->max_rows)
+        thread_state.rows_used = std::make_shared<std::atomic<uint64_t>>(0);
     while (true) {
-        auto exit                  = fc::make_scoped_exit([&] { thread_state.query_session.reset(); });
-        thread_state.query_session = thread_state.shared->db_iface->create_query_session();
-        thread_state.fill_status   = thread_state.query_session->get_fill_status();
+        auto exit = fc::make_scoped_exit([&] {
+            thread_state.cursors.clear();
+            if (thread_state.query_session)
+                thread_state.trace.rows_scanned += thread_state.query_session->rows_scanned;
+            thread_state.query_session.reset();
+        });
+        auto snapshot                        = thread_state.shared->fill_status->get();
+        thread_state.query_session           = thread_state.shared->db_iface->create_query_session();
+        thread_state.query_session->deadline = thread_state.deadline;
+        thread_state.fill_status             = snapshot->status;
+        thread_state.fork_generation         = snapshot->fork_generation;
         if (!thread_state.fill_status.head)
             throw std::runtime_error("database is empty");
         fill_context_data(thread_state);
         if (f())
             return;
+        if (thread_state.stream && thread_state.stream->started())
+            throw std::runtime_error("fork event after part of the reply was sent");
         if (++num_tries >= 4)
             throw std::runtime_error("too many fork events during request");
+        ++thread_state.trace.retries;
         ilog("retry request");
     }
 }
 
+// shared_state::wasm_limiter slots a request holds until it finishes: one per distinct WASM, however many
+// of its sub-requests use it and whichever threads they run on, so a request never counts against itself.
+class wasm_slots {
+  private:
+    std::shared_ptr<concurrency_limiter> limiter;
+    std::vector<std::string>             held = {};
+
+  public:
+    explicit wasm_slots(const std::shared_ptr<concurrency_limiter>& limiter)
+        : limiter(limiter) {}
+    wasm_slots(const wasm_slots&) = delete;
+
+    ~wasm_slots() {
+        for (auto& key : held)
+            limiter->release(key);
+    }
+
+    void acquire(const std::string& key) {
+        if (!limiter || std::find(held.begin(), held.end(), key) != held.end())
+            return;
+        if (!limiter->acquire(key))
+            throw query_error(503, "too many concurrent " + key + " queries");
+        held.push_back(key);
+    }
+};
+
+// Runs the WASM short_name. The caller holds its wasm_slots.
 static void run_query(wasm_ql::thread_state& thread_state, abieos::name short_name) {
-    auto      code = backend_t::read_wasm(thread_state.shared->wasm_dir + "/" + (std::string)short_name + "-server.wasm");
-    backend_t backend(code);
-    callbacks cb{thread_state, backend};
-    backend.set_wasm_allocator(&thread_state.wa);
+    auto&     instance = get_instance(thread_state, short_name);
+    callbacks cb{thread_state, instance};
+    auto      close_cursors = fc::make_scoped_exit([&] { thread_state.cursors.clear(); });
+    thread_state.reply.clear(); // append_output_data builds on it
+
+    // Time inside host callbacks is already counted under other phases
+    auto& trace      = thread_state.trace;
+    auto  outside    = trace.database + trace.alloc;
+    auto  wasm_timer = trace_phase(trace.wasm);
+    auto  exclude    = fc::make_scoped_exit([&] { trace.wasm -= trace.database + trace.alloc - outside; });
+    try {
+        instance.run(cb);
+    } catch (...) {
+        // Don't trust an instance which was interrupted part-way through execution
+        thread_state.instances.erase(short_name);
+        throw;
+    }
+}
+
+// Calls f(state, i) for each i in [0, n). The calling thread works through the indexes itself while idle
+// pool threads join in using states borrowed from the cache; helpers don't take queue slots from other
+// requests. Helpers use the caller's fill_status, so every call sees the same snapshot, but each opens its
+// own query_session; a helper which sees a fork stops, and run_parallel returns false so the caller retries.
+// The caller never waits on a helper which hasn't started; those find nothing left to do, which keeps a
+// saturated pool from deadlocking.
+template <typename F>
+static bool run_parallel(wasm_ql::thread_state& thread_state, uint32_t n, F f) {
+    struct control {
+        std::mutex              mutex  = {};
+        std::condition_variable cv     = {};
+        std::atomic<uint32_t>   next   = 0;
+        uint32_t                active = 0;     // helpers which started before the caller finished
+        bool                    done   = false; // caller finished; helpers starting later do nothing
+        bool                    forked = false; // a helper's session may not match the caller's snapshot
+        std::exception_ptr      error  = {};
+        query_trace             trace  = {}; // helpers' work
+    };
+    auto ctrl = std::make_shared<control>();
+
+    auto drain = [&](wasm_ql::thread_state& state) {
+        try {
+            for (uint32_t i; (i = ctrl->next++) < n;)
+                f(state, i);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock{ctrl->mutex};
+            if (!ctrl->error)
+                ctrl->error = std::current_exception();
+            ctrl->next = n;
+        }
+    };
+
+    for (uint32_t i = 1; i < n; ++i) {
+        bool posted = thread_state.cache->get_pool().try_post_idle([ctrl, n, &drain, &thread_state] {
+            {
+                std::lock_guard<std::mutex> lock{ctrl->mutex};
+                if (ctrl->done)
+                    return;
+                ++ctrl->active;
+            }
+            auto finish = fc::make_scoped_exit([&] {
+                std::lock_guard<std::mutex> lock{ctrl->mutex};
+                --ctrl->active;
+                ctrl->cv.notify_all();
+            });
+            try {
+                auto helper                     = thread_state.cache->get_state();
+                helper->query_session           = thread_state.shared->db_iface->create_query_session();
+                helper->query_session->deadline = thread_state.deadline;
+                helper->fill_status             = thread_state.fill_status;
+                helper->fork_generation         = thread_state.fork_generation;
+                helper->trace                   = {};
+                helper->deadline                = thread_state.deadline;
+                helper->rows_used               = thread_state.rows_used;
+                fill_context_data(*helper);
+                bool forked = did_fork(*helper);
+                if (!forked)
+                    drain(*helper);
+                forked = forked || did_fork(*helper);
+                helper->trace.rows_scanned += helper->query_session->rows_scanned;
+                helper->query_session.reset();
+                {
+                    std::lock_guard<std::mutex> lock{ctrl->mutex};
+                    ctrl->trace.add(helper->trace);
+                    if (forked) {
+                        ctrl->forked = true;
+                        ctrl->next   = n;
+                    }
+                }
+                thread_state.cache->store_state(std::move(helper));
+            } catch (...) {
+                std::lock_guard<std::mutex> lock{ctrl->mutex};
+                if (!ctrl->error)
+                    ctrl->error = std::current_exception();
+                ctrl->next = n;
+            }
+        });
+        if (!posted)
+            break;
+    }
 
-    rhf_t::resolve(backend.get_module());
-    backend.initialize(&cb);
-    backend(&cb, "env", "initialize");
-    backend(&cb, "env", "run_query");
+    drain(thread_state);
+    std::unique_lock<std::mutex> lock{ctrl->mutex};
+    ctrl->done = true;
+    ctrl->cv.wait(lock, [&] { return !ctrl->active; });
+    thread_state.trace.add(ctrl->trace);
+    if (ctrl->error)
+        std::rethrow_exception(ctrl->error);
+    return !ctrl->forked;
 }
 
 std::vector<char> query(wasm_ql::thread_state& thread_state, const std::vector<char>& request) {
+    struct sub_request {
+        abieos::name         short_name = {};
+        abieos::input_buffer payload    = {};
+    };
+    abieos::input_buffer request_bin{request.data(), request.data() + request.size()};
+    auto                 num_requests = abieos::bin_to_native<abieos::varuint32>(request_bin).value;
+    if (num_requests > request_bin.end - request_bin.pos)
+        throw std::runtime_error("request is truncated");
+    std::vector<sub_request> sub_requests(num_requests);
+    for (auto& sub : sub_requests) {
+        sub.payload  = abieos::bin_to_native<abieos::input_buffer>(request_bin);
+        auto ns_name = abieos::bin_to_native<abieos::name>(sub.payload);
+        if (ns_name != "local"_n)
+            throw std::runtime_error("unknown namespace: " + (std::string)ns_name);
+        sub.short_name = abieos::bin_to_native<abieos::name>(sub.payload);
+    }
+
+    wasm_slots slots{thread_state.shared->wasm_limiter};
+    for (auto& sub : sub_requests)
+        slots.acquire((std::string)sub.short_name);
+
     std::vector<char> result;
     retry_loop(thread_state, [&]() {
-        abieos::input_buffer request_bin{request.data(), request.data() + request.size()};
-        auto                 num_requests = abieos::bin_to_native<abieos::varuint32>(request_bin).value;
-        result.clear();
-        abieos::push_varuint32(result, num_requests);
-        for (uint32_t request_index = 0; request_index < num_requests; ++request_index) {
-            thread_state.request = abieos::bin_to_native<abieos::input_buffer>(request_bin);
-            auto ns_name         = abieos::bin_to_native<abieos::name>(thread_state.request);
-            if (ns_name != "local"_n)
-                throw std::runtime_error("unknown namespace: " + (std::string)ns_name);
-            auto short_name = abieos::bin_to_native<abieos::name>(thread_state.request);
-
-            run_query(thread_state, short_name);
-            if (did_fork(thread_state))
+        std::vector<std::vector<char>> replies(sub_requests.size());
+        std::vector<uint32_t>          newest_blocks(sub_requests.size());
+        std::vector<char>              used_head(sub_requests.size());
+        auto                           run = [&](wasm_ql::thread_state& state, uint32_t i) {
+            state.request = sub_requests[i].payload;
+            run_query(state, sub_requests[i].short_name);
+            replies[i].swap(state.reply);
+            state.reply.clear();
+            newest_blocks[i] = state.query_session->newest_block_used.value_or(state.fill_status.head);
+            used_head[i]     = state.query_session->used_head || !state.query_session->newest_block_used;
+        };
+        if (sub_requests.size() > 1 && thread_state.cache) {
+            if (!run_parallel(thread_state, sub_requests.size(), run))
                 return false;
+        } else {
+            for (uint32_t i = 0; i < sub_requests.size(); ++i)
+                run(thread_state, i);
+        }
+        if (did_fork(thread_state))
+            return false;
+        thread_state.newest_block_used = thread_state.fill_status.head;
+        if (!newest_blocks.empty())
+            thread_state.newest_block_used = *std::max_element(newest_blocks.begin(), newest_blocks.end());
+        thread_state.used_head = std::find(used_head.begin(), used_head.end(), true) != used_head.end();
 
-            // elog("result: ${s} ${x}", ("s", thread_state.reply.size())("x", fc::to_hex(thread_state.reply)));
-            abieos::push_varuint32(result, thread_state.reply.size());
-            result.insert(result.end(), thread_state.reply.begin(), thread_state.reply.end());
+        // elog("result: ${s} ${x}", ("s", thread_state.reply.size())("x", fc::to_hex(thread_state.reply)));
+        result.clear();
+        abieos::push_varuint32(result, sub_requests.size());
+        for (auto& reply : replies) {
+            abieos::push_varuint32(result, reply.size());
+            result.insert(result.end(), reply.begin(), reply.end());
         }
         return true;
     });
@@ -166,11 +780,236 @@ const std::vector<char>& legacy_query(wasm_ql::thread_state& thread_state, const
     abieos::native_to_bin(target, req);
     abieos::native_to_bin(request, req);
     thread_state.request = abieos::input_buffer{req.data(), req.data() + req.size()};
+    wasm_slots slots{thread_state.shared->wasm_limiter};
+    slots.acquire(target);
     retry_loop(thread_state, [&]() {
         run_query(thread_state, "legacy"_n);
-        return !did_fork(thread_state);
+        if (did_fork(thread_state))
+            return false;
+        thread_state.newest_block_used = thread_state.query_session->newest_block_used.value_or(thread_state.fill_status.head);
+        thread_state.used_head         = thread_state.query_session->used_head || !thread_state.query_session->newest_block_used;
+        return true;
     });
     return thread_state.reply;
 }
 
+bool concurrency_limiter::acquire(const std::string& key) {
+    std::lock_guard<std::mutex> lock{mutex};
+    auto&                       n = running[key];
+    if (n >= limit)
+        return false;
+    ++n;
+    return true;
+}
+
+void concurrency_limiter::release(const std::string& key) {
+    std::lock_guard<std::mutex> lock{mutex};
+    auto                        it = running.find(key);
+    if (it != running.end() && !--it->second)
+        running.erase(it);
+}
+
+fill_status_tracker::~fill_status_tracker() { stop(); }
+
+bool fill_status_tracker::forked(const state_history::fill_status& prev, const state_history::fill_status& next) {
+    if (!prev.head)
+        return false;
+    if (next.head < prev.head)
+        return true;
+    if (next.head == prev.head)
+        return next.head_id.value != prev.head_id.value;
+    auto id = session->get_block_id(prev.head);
+    return !id || id->value != prev.head_id.value;
+}
+
+std::shared_ptr<const fill_status_snapshot> fill_status_tracker::refresh() {
+    std::lock_guard<std::mutex> lock{mutex};
+    try {
+        // Read the backend's generation first; the status read after it is at least that new
+        auto backend_generation = db_iface->get_fork_generation();
+        auto prev               = std::atomic_load(&current);
+        if (!session)
+            session = db_iface->create_query_session();
+
+        auto next                = std::make_shared<fill_status_snapshot>();
+        next->status             = session->get_fill_status();
+        next->backend_generation = backend_generation;
+        if (prev) {
+            next->fork_generation = prev->fork_generation;
+            if (prev->backend_generation != backend_generation || forked(prev->status, next->status))
+                ++next->fork_generation;
+        }
+        std::shared_ptr<const fill_status_snapshot> result = next;
+        std::atomic_store(&current, result);
+        return result;
+    } catch (...) {
+        // Reconnect next time
+        session.reset();
+        throw;
+    }
+}
+
+std::shared_ptr<const fill_status_snapshot> fill_status_tracker::get() {
+    auto result = std::atomic_load(&current);
+    if (!result || result->backend_generation != db_iface->get_fork_generation())
+        return refresh();
+    return result;
+}
+
+void fill_status_tracker::start() {
+    try {
+        refresh();
+    } catch (const std::exception& e) {
+        elog("unable to read fill_status: ${e}", ("e", e.what()));
+    }
+    poller = std::thread([this] {
+        std::unique_lock<std::mutex> lock{stop_mutex};
+        while (!stop_cv.wait_for(lock, interval, [&] { return stopping; })) {
+            lock.unlock();
+            try {
+                refresh();
+            } catch (const std::exception& e) {
+                elog("unable to read fill_status: ${e}", ("e", e.what()));
+            }
+            lock.lock();
+        }
+    });
+}
+
+void fill_status_tracker::stop() {
+    {
+        std::lock_guard<std::mutex> lock{stop_mutex};
+        stopping = true;
+    }
+    stop_cv.notify_all();
+    if (poller.joinable())
+        poller.join();
+}
+
+static thread_local const query_pool* current_pool       = nullptr;
+static thread_local int               current_pool_index = -1;
+
+query_pool::query_pool(int num_threads, uint32_t max_queue)
+    : max_queue(max_queue)
+    , thread_count(num_threads) {
+    threads.reserve(num_threads);
+    for (int i = 0; i < num_threads; ++i)
+        threads.emplace_back([this, i] { run(i); });
+}
+
+query_pool::~query_pool() { stop(); }
+
+bool query_pool::try_post(std::function<void()> f) {
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        if (stopping || queue.size() >= max_queue)
+            return false;
+        queue.push_back(std::move(f));
+    }
+    cv.notify_one();
+    return true;
+}
+
+bool query_pool::try_post_idle(std::function<void()> f) {
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        if (stopping || idle <= queue.size() + idle_queue.size())
+            return false;
+        idle_queue.push_back(std::move(f));
+    }
+    cv.notify_one();
+    return true;
+}
+
+void query_pool::stop() {
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        stopping = true;
+    }
+    cv.notify_all();
+    for (auto& t : threads)
+        t.join();
+    threads.clear();
+}
+
+size_t query_pool::queued() {
+    std::lock_guard<std::mutex> lock{mutex};
+    return queue.size();
+}
+
+int query_pool::current_index() const { return current_pool == this ? current_pool_index : -1; }
+
+void query_pool::run(int index) {
+    current_pool       = this;
+    current_pool_index = index;
+    while (true) {
+        std::function<void()> f;
+        {
+            std::unique_lock<std::mutex> lock{mutex};
+            ++idle;
+            cv.wait(lock, [&] { return stopping || !queue.empty() || !idle_queue.empty(); });
+            --idle;
+            if (stopping)
+                return;
+            auto& q = idle_queue.empty() ? queue : idle_queue;
+            f       = std::move(q.front());
+            q.pop_front();
+        }
+        try {
+            f();
+        } catch (const std::exception& e) {
+            elog("query thread: ${e}", ("e", e.what()));
+        } catch (...) {
+            elog("query thread: unknown exception");
+        }
+    }
+}
+
+thread_state_cache::thread_state_cache(const std::shared_ptr<const wasm_ql::shared_state>& shared_state, const std::shared_ptr<query_pool>& pool)
+    : shared_state(shared_state)
+    , pool(pool)
+    , slots(pool->size())
+    , spares(new std::atomic<thread_state*>[2 * pool->size() + 2])
+    , num_spares(2 * pool->size() + 2) {
+    for (size_t i = 0; i < num_spares; ++i)
+        spares[i] = nullptr;
+}
+
+thread_state_cache::~thread_state_cache() {
+    for (size_t i = 0; i < num_spares; ++i)
+        delete spares[i].exchange(nullptr);
+}
+
+std::unique_ptr<thread_state> thread_state_cache::get_state() {
+    auto index = pool->current_index();
+    if (index >= 0 && slots[index].state)
+        return std::move(slots[index].state);
+    for (size_t i = 0; i < num_spares; ++i)
+        if (spares[i].load(std::memory_order_relaxed))
+            if (auto state = spares[i].exchange(nullptr))
+                return std::unique_ptr<thread_state>{state};
+
+    // Created on the thread which will use it, so its memory is first touched there
+    auto result    = std::make_unique<thread_state>();
+    result->shared = shared_state;
+    result->cache  = this;
+    return result;
+}
+
+void thread_state_cache::store_state(std::unique_ptr<thread_state> state) {
+    auto index = pool->current_index();
+    if (index >= 0 && !slots[index].state) {
+        slots[index].state = std::move(state);
+        return;
+    }
+    for (size_t i = 0; i < num_spares; ++i) {
+        thread_state* expected = nullptr;
+        if (!spares[i].load(std::memory_order_relaxed) && spares[i].compare_exchange_strong(expected, state.get())) {
+            state.release();
+            return;
+        }
+    }
+    // Enough spares already; let this one go
+}
+
 } // namespace wasm_ql
@@ -5,24 +5,275 @@
 
 #include <eosio/vm/backend.hpp>
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+
 namespace wasm_ql {
 
+// Identifies a particular version of a file on disk
+struct file_identity {
+    uint64_t device     = {};
+    uint64_t inode      = {};
+    int64_t  mtime_sec  = {};
+    int64_t  mtime_nsec = {};
+    uint64_t size       = {};
+
+    friend bool operator==(const file_identity& a, const file_identity& b) {
+        return std::tie(a.device, a.inode, a.mtime_sec, a.mtime_nsec, a.size) ==
+               std::tie(b.device, b.inode, b.mtime_sec, b.mtime_nsec, b.size);
+    }
+    friend bool operator!=(const file_identity& a, const file_identity& b) { return !(a == b); }
+};
+
+// A query WASM loaded from wasm_dir. Immutable once created; threads instantiate it independently.
+struct wasm_module {
+    abieos::name         short_name = {};
+    file_identity        identity   = {};
+    uint64_t             hash       = {};
+    eosio::vm::wasm_code code       = {};
+};
+
+// Process-wide cache of query WASMs, keyed by short name.
+//
+// After start_watching(), a background thread loads every *-server.wasm in wasm_dir and uses inotify to
+// pick up new, changed, and removed files. Each change is validated then published by atomically
+// replacing the whole table, so requests never wait on a load and in-flight requests keep the version
+// they started with. Without a watcher (non-Linux, or inotify failed), get() checks the file's identity
+// on each call and reloads it when it changes.
+class module_cache {
+  private:
+    using module_map = std::map<abieos::name, std::shared_ptr<const wasm_module>>;
+
+    std::string                       wasm_dir     = {};
+    std::mutex                        mutex        = {}; // serializes updates to modules
+    std::shared_ptr<const module_map> modules      = std::make_shared<module_map>();
+    std::atomic<uint64_t>             version      = 0; // bumped whenever a module is added, replaced, or removed
+    std::atomic<bool>                 watching     = false;
+    std::thread                       watcher      = {};
+    int                               stop_pipe[2] = {-1, -1};
+
+    std::string filename(abieos::name short_name) const { return wasm_dir + "/" + (std::string)short_name + "-server.wasm"; }
+    void        set(abieos::name short_name, const std::shared_ptr<const wasm_module>& module);
+    void        load(abieos::name short_name, bool validate);
+    void        scan();
+    void        watch(int inotify_fd);
+
+  public:
+    module_cache(const std::string& wasm_dir)
+        : wasm_dir(wasm_dir) {}
+
+    ~module_cache();
+
+    void                               start_watching();
+    void                               stop_watching();
+    std::shared_ptr<const wasm_module> get(abieos::name short_name);
+    uint64_t                           get_version() const { return version.load(); }
+};
+
+// fill_status at some moment, plus a counter which changes whenever blocks at or below an
+// earlier snapshot's head are replaced
+struct fill_status_snapshot {
+    state_history::fill_status status             = {};
+    uint64_t                   fork_generation    = 0;
+    uint64_t                   backend_generation = 0; // database_interface::get_fork_generation() when taken
+};
+
+// Polls fill_status in the background so requests don't each read it from the database. get() is
+// lock-free unless the backend reports a fork the last poll hasn't seen.
+class fill_status_tracker {
+  private:
+    std::shared_ptr<database_interface>         db_iface;
+    std::chrono::milliseconds                   interval;
+    std::mutex                                  mutex      = {}; // serializes refresh()
+    std::unique_ptr<::query_session>            session    = {};
+    std::shared_ptr<const fill_status_snapshot> current    = {};
+    std::mutex                                  stop_mutex = {};
+    std::condition_variable                     stop_cv    = {};
+    bool                                        stopping   = false;
+    std::thread                                 poller     = {};
+
+    bool                                        forked(const state_history::fill_status& prev, const state_history::fill_status& next);
+    std::shared_ptr<const fill_status_snapshot> refresh();
+
+  public:
+    fill_status_tracker(const std::shared_ptr<database_interface>& db_iface, std::chrono::milliseconds interval)
+        : db_iface(db_iface)
+        , interval(interval) {}
+
+    ~fill_status_tracker();
+
+    void                                        start();
+    void                                        stop();
+    std::shared_ptr<const fill_status_snapshot> get();
+};
+
+enum class vm_type {
+    interpreter,
+    jit,
+};
+
+// Caps how many queries may run each WASM at once, so one expensive query can't occupy every query thread
+class concurrency_limiter {
+  private:
+    std::mutex                      mutex   = {};
+    std::map<std::string, uint32_t> running = {};
+    uint32_t                        limit;
+
+  public:
+    explicit concurrency_limiter(uint32_t limit)
+        : limit(limit) {}
+
+    // Returns false, without counting it, if key is already at the limit
+    bool acquire(const std::string& key);
+    void release(const std::string& key);
+};
+
 struct shared_state {
-    bool                                console      = {};
-    std::string                         allow_origin = {};
-    std::string                         wasm_dir     = {};
-    std::string                         static_dir   = {};
-    std::shared_ptr<database_interface> db_iface     = {};
+    bool                                 console      = {};
+    std::string                          allow_origin = {};
+    std::string                          wasm_dir     = {};
+    std::string                          static_dir   = {};
+    vm_type                              vm           = vm_type::interpreter;
+    uint64_t                             max_rows     = {}; // rows one request may scan; 0 is unlimited
+    std::chrono::milliseconds            timeout      = {}; // per request, including its wait for a thread; 0 is unlimited
+    std::shared_ptr<concurrency_limiter> wasm_limiter = {}; // null if unlimited
+    std::shared_ptr<database_interface>  db_iface     = {};
+    std::shared_ptr<module_cache>        modules      = {};
+    std::shared_ptr<fill_status_tracker> fill_status  = {};
+
+    // Deadline for a request which arrived at start
+    std::chrono::steady_clock::time_point deadline_after(std::chrono::steady_clock::time_point start) const {
+        if (!timeout.count())
+            return std::chrono::steady_clock::time_point::max();
+        return start + timeout;
+    }
+};
+
+struct module_instance;
+class thread_state_cache;
+
+// Receives a reply in pieces while the query which produces it still runs
+struct output_stream {
+    virtual ~output_stream() {}
+
+    // How much output to collect before passing it to write()
+    virtual size_t chunk_size() const = 0;
+
+    // True once write() has been called; the output so far can no longer be taken back
+    virtual bool started() const = 0;
+
+    // May block until the client catches up, but throws query_error once deadline passes
+    virtual void write(std::vector<char> chunk, std::chrono::steady_clock::time_point deadline) = 0;
+};
+
+// Where a request's time went. Sub-requests which run in parallel each add their own time, so the phases
+// can sum to more than the request took.
+struct query_trace {
+    std::chrono::steady_clock::duration database       = {}; // in query_database, query_open, query_next_batch, ...
+    std::chrono::steady_clock::duration alloc          = {}; // in the WASM's allocator, plus copying results into its memory
+    std::chrono::steady_clock::duration wasm           = {}; // running WASM, excluding the above
+    uint64_t                            rows_scanned   = {}; // as the database backend counts them
+    uint64_t                            bytes_streamed = {}; // sent through output_stream
+    uint32_t                            retries        = {}; // reruns caused by forks
+
+    void add(const query_trace& other) {
+        database += other.database;
+        alloc += other.alloc;
+        wasm += other.wasm;
+        rows_scanned += other.rows_scanned;
+        bytes_streamed += other.bytes_streamed;
+        retries += other.retries;
+    }
 };
 
 struct thread_state {
-    std::shared_ptr<const shared_state> shared          = {};
-    eosio::vm::wasm_allocator           wa              = {};
-    std::vector<char>                   database_status = {};
-    abieos::input_buffer                request         = {}; // todo: rename
-    std::vector<char>                   reply           = {}; // todo: rename
-    std::unique_ptr<::query_session>    query_session   = {};
-    state_history::fill_status          fill_status     = {};
+    std::shared_ptr<const shared_state>                      shared            = {};
+    eosio::vm::wasm_allocator                                wa                = {};
+    std::vector<char>                                        database_status   = {};
+    abieos::input_buffer                                     request           = {}; // todo: rename
+    std::vector<char>                                        reply             = {}; // todo: rename
+    std::unique_ptr<::query_session>                         query_session     = {};
+    state_history::fill_status                               fill_status       = {};
+    uint64_t                                                 fork_generation   = {}; // from the fill_status_snapshot in use
+    uint32_t                                                 newest_block_used = {}; // highest block the last reply depends on
+    bool                                                     used_head         = {}; // the last reply may change as head moves
+    std::map<abieos::name, std::shared_ptr<module_instance>> instances         = {}; // warm, initialized instances
+    std::vector<std::unique_ptr<query_cursor>>               cursors           = {}; // cursors open by the running query
+    thread_state_cache*                                      cache             = {}; // owner; lends out states for sub-requests
+    output_stream*                                           stream            = {}; // where append_output_data sends full chunks, if anywhere
+    query_trace                                              trace             = {}; // of the running request; callers reset it
+    std::shared_ptr<std::atomic<uint64_t>>                   rows_used         = {}; // by the running request and its helpers, if limited
+
+    // When the running request must finish. Callers set it; left alone, it never passes.
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+};
+
+// Fixed-size pool of threads which run queries, separate from the threads which handle HTTP I/O. Callers
+// are expected to fail fast when try_post() reports the queue is full.
+class query_pool {
+  private:
+    std::mutex                        mutex        = {};
+    std::condition_variable           cv           = {};
+    std::deque<std::function<void()>> queue        = {};
+    std::deque<std::function<void()>> idle_queue   = {}; // from try_post_idle(); runs first
+    uint32_t                          max_queue    = {};
+    uint32_t                          idle         = {}; // threads waiting for work
+    bool                              stopping     = false;
+    int                               thread_count = {};
+    std::vector<std::thread>          threads      = {};
+
+    void run(int index);
+
+  public:
+    query_pool(int num_threads, uint32_t max_queue);
+    ~query_pool();
+
+    // Queue f to run on a pool thread. Returns false, without queuing, if the queue is full or the pool is stopping.
+    bool try_post(std::function<void()> f);
+
+    // Run f on a thread which is idle now. Returns false if none is. Doesn't count against the queue limit.
+    bool try_post_idle(std::function<void()> f);
+    void stop();
+
+    int size() const { return thread_count; }
+
+    // Number of tasks waiting for a thread
+    size_t queued();
+
+    // Index of the calling thread within this pool, or -1 if it isn't one of the pool's threads
+    int current_index() const;
+};
+
+// Lends out thread_states. Each pool thread keeps one in its own slot, so the common case takes no lock and
+// the state's memory (mostly its wasm_allocator) stays warm in the cache, and on the NUMA node, of the
+// thread which first touched it. States needed beyond that, e.g. for sub-requests, come from a small
+// lock-free set of spares.
+class thread_state_cache {
+  private:
+    struct alignas(64) slot {
+        std::unique_ptr<thread_state> state = {};
+    };
+
+    std::shared_ptr<const wasm_ql::shared_state>  shared_state;
+    std::shared_ptr<query_pool>                   pool;
+    std::vector<slot>                             slots;      // by pool thread index; only that thread uses it
+    std::unique_ptr<std::atomic<thread_state*>[]> spares;     // owned; null entries are free
+    size_t                                        num_spares;
+
+  public:
+    thread_state_cache(const std::shared_ptr<const wasm_ql::shared_state>& shared_state, const std::shared_ptr<query_pool>& pool);
+    ~thread_state_cache();
+
+    // Pool which runs this cache's queries
+    query_pool& get_pool() { return *pool; }
+
+    std::unique_ptr<thread_state> get_state();
+    void                          store_state(std::unique_ptr<thread_state> state);
 };
 
 void                     register_callbacks();
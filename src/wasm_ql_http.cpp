@@ -8,64 +8,63 @@
 // file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
 
 #include "wasm_ql_http.hpp"
+#include "lru_cache.hpp"
+#include "metrics.hpp"
+#include "util.hpp"
 
 #include <boost/asio/bind_executor.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
 #include <boost/asio/signal_set.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
+#include <boost/beast/websocket.hpp>
 #include <boost/make_unique.hpp>
 #include <boost/optional.hpp>
 
 #include <fc/exception/exception.hpp>
 #include <fc/log/logger.hpp>
+#include <fc/scoped_exit.hpp>
 
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <functional>
 #include <iostream>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
-namespace beast = boost::beast;         // from <boost/beast.hpp>
-namespace http  = beast::http;          // from <boost/beast/http.hpp>
-namespace net   = boost::asio;          // from <boost/asio.hpp>
-using tcp       = boost::asio::ip::tcp; // from <boost/asio/ip/tcp.hpp>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-using namespace std::literals;
-
-namespace wasm_ql {
-
-class thread_state_cache {
-  private:
-    std::mutex                                   mutex;
-    std::shared_ptr<const wasm_ql::shared_state> shared_state;
-    std::vector<std::unique_ptr<thread_state>>   states;
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
-  public:
-    thread_state_cache(const std::shared_ptr<const wasm_ql::shared_state>& shared_state)
-        : shared_state(shared_state) {}
+namespace beast     = boost::beast;         // from <boost/beast.hpp>
+namespace http      = beast::http;          // from <boost/beast/http.hpp>
+namespace websocket = beast::websocket;     // from <boost/beast/websocket.hpp>
+namespace net       = boost::asio;          // from <boost/asio.hpp>
+using tcp           = boost::asio::ip::tcp; // from <boost/asio/ip/tcp.hpp>
 
-    std::unique_ptr<thread_state> get_state() {
-        std::lock_guard<std::mutex> lock{mutex};
-        if (states.empty()) {
-            auto result    = std::make_unique<thread_state>();
-            result->shared = shared_state;
-            return result;
-        }
-        auto result = std::move(states.back());
-        states.pop_back();
-        return result;
-    }
+using namespace std::literals;
 
-    void store_state(std::unique_ptr<thread_state> state) {
-        std::lock_guard<std::mutex> lock{mutex};
-        states.push_back(std::move(state));
-    }
-};
+namespace wasm_ql {
 
 // Report a failure
 static void fail(beast::error_code ec, const char* what) { elog("${w}: ${s}", ("w", what)("s", ec.message())); }
@@ -126,6 +125,12 @@ beast::string_view mime_type(beast::string_view path) {
     return "application/text";
 }
 
+// Whether compressing a file of this type is likely to pay off
+static bool compressible(beast::string_view mime_type) {
+    return mime_type.starts_with("text/") || mime_type == "application/javascript" || mime_type == "application/json" ||
+           mime_type == "application/wasm" || mime_type == "application/xml" || mime_type == "image/svg+xml";
+}
+
 // Append an HTTP rel-path to a local filesystem path.
 // The returned path is normalized for the platform.
 std::string path_cat(beast::string_view base, beast::string_view path) {
@@ -149,14 +154,1127 @@ std::string path_cat(beast::string_view base, beast::string_view path) {
     return result;
 }
 
+// Body which refers to an immutable, shared buffer. Lets cached and coalesced responses go out without
+// copying the reply.
+struct shared_vector_body {
+    using value_type = std::shared_ptr<const std::vector<char>>;
+
+    static std::uint64_t size(const value_type& body) { return body ? body->size() : 0; }
+
+    class writer {
+        const value_type& body_;
+
+      public:
+        using const_buffers_type = net::const_buffer;
+
+        template <bool isRequest, class Fields>
+        writer(const http::header<isRequest, Fields>&, const value_type& body)
+            : body_(body) {}
+
+        void init(beast::error_code& ec) { ec = {}; }
+
+        boost::optional<std::pair<const_buffers_type, bool>> get(beast::error_code& ec) {
+            ec = {};
+            if (!body_ || body_->empty())
+                return boost::none;
+            return {{const_buffers_type{body_->data(), body_->size()}, false}};
+        }
+    };
+};
+
+enum class content_encoding {
+    identity,
+    deflate,
+    gzip,
+};
+
+static const char* to_string(content_encoding encoding) {
+    switch (encoding) {
+    case content_encoding::deflate: return "deflate";
+    case content_encoding::gzip: return "gzip";
+    default: return "identity";
+    }
+}
+
+// Picks the best encoding an Accept-Encoding header allows, preferring gzip over deflate
+static content_encoding negotiate_encoding(beast::string_view accept_encoding) {
+    bool gzip    = false;
+    bool deflate = false;
+    for (const auto& [coding, params] : http::ext_list{accept_encoding}) {
+        bool refused = false;
+        for (const auto& [name, value] : params)
+            if (beast::iequals(name, "q"))
+                refused = std::strtod(value.to_string().c_str(), nullptr) <= 0;
+        if (refused)
+            continue;
+        if (beast::iequals(coding, "gzip") || beast::iequals(coding, "x-gzip"))
+            gzip = true;
+        else if (beast::iequals(coding, "deflate"))
+            deflate = true;
+    }
+    if (gzip)
+        return content_encoding::gzip;
+    if (deflate)
+        return content_encoding::deflate;
+    return content_encoding::identity;
+}
+
+// Strong ETags must differ between encodings of the same reply
+static std::string encoded_etag(const std::string& etag, content_encoding encoding) {
+    if (etag.empty() || encoding == content_encoding::identity)
+        return etag;
+    return etag.substr(0, etag.size() - 1) + "-" + to_string(encoding) + "\"";
+}
+
+// A query reply plus compressed copies of it. Copies are made on demand, on query threads, and kept for
+// later requests which share the reply.
+class encoded_reply {
+  private:
+    std::mutex                               mutex     = {};
+    std::shared_ptr<const std::vector<char>> bodies[3] = {}; // indexed by content_encoding
+
+  public:
+    explicit encoded_reply(std::vector<char> body) {
+        bodies[(int)content_encoding::identity] = std::make_shared<const std::vector<char>>(std::move(body));
+    }
+
+    const std::vector<char>& body() const { return *bodies[(int)content_encoding::identity]; }
+
+    // Returns the body in encoding, or null if nothing has compressed it yet
+    std::shared_ptr<const std::vector<char>> find(content_encoding encoding) {
+        std::lock_guard<std::mutex> lock{mutex};
+        return bodies[(int)encoding];
+    }
+
+    // Returns the body in encoding, compressing it if needed
+    std::shared_ptr<const std::vector<char>> get(content_encoding encoding, int level) {
+        if (auto result = find(encoding))
+            return result;
+        eosio::input_stream in{body().data(), body().data() + body().size()};
+        auto                compressed = std::make_shared<const std::vector<char>>(
+            encoding == content_encoding::gzip ? gzip_compress(in, level) : zlib_compress(in, level));
+        std::lock_guard<std::mutex> lock{mutex};
+        if (!bodies[(int)encoding])
+            bodies[(int)encoding] = std::move(compressed);
+        return bodies[(int)encoding];
+    }
+};
+
+// Complete response bodies for /wasmql/v1/query and /v1/ requests, keyed on target plus request body.
+// A response which only read irreversible snapshots stays until history is trimmed (fill_status.first
+// moves) or a query WASM changes. Other responses, including any which saw head or the database status,
+// are only kept if their target has a TTL.
+class response_cache {
+  public:
+    struct entry {
+        std::shared_ptr<encoded_reply>        body           = {};
+        std::string                           etag           = {}; // of the identity encoding
+        uint32_t                              first          = {}; // fill_status.first when stored
+        uint64_t                              module_version = {}; // module_cache::get_version() before the query ran
+        bool                                  immutable      = {}; // only depends on irreversible snapshots
+        std::chrono::steady_clock::time_point expires        = {}; // ignored if immutable
+    };
+
+  private:
+    lru_cache<std::string, entry>                    entries;
+    std::map<std::string, std::chrono::milliseconds> ttls;
+    std::atomic<uint64_t>                            num_hits   = 0;
+    std::atomic<uint64_t>                            num_misses = 0;
+
+  public:
+    response_cache(size_t max_bytes, const std::map<std::string, std::chrono::milliseconds>& ttls)
+        : entries(max_bytes)
+        , ttls(ttls) {}
+
+    static std::string key(beast::string_view target, const std::vector<char>& body) {
+        std::string result(target.data(), target.size());
+        result.push_back(0);
+        result.append(body.begin(), body.end());
+        return result;
+    }
+
+    std::optional<entry> get(const std::string& key, uint32_t first, uint64_t module_version) {
+        auto result = entries.get(key);
+        if (!result || result->module_version != module_version ||
+            (result->immutable ? result->first != first : std::chrono::steady_clock::now() >= result->expires)) {
+            num_misses.fetch_add(1, std::memory_order_relaxed);
+            return {};
+        }
+        num_hits.fetch_add(1, std::memory_order_relaxed);
+        return result;
+    }
+
+    uint64_t get_hits() const { return num_hits.load(std::memory_order_relaxed); }
+    uint64_t get_misses() const { return num_misses.load(std::memory_order_relaxed); }
+
+    // Stores the reply thread_state just produced. Returns its ETag, or "" if the reply isn't cacheable.
+    std::string put(
+        const std::string& target, const std::string& key, uint64_t module_version, const thread_state& thread_state,
+        const std::shared_ptr<encoded_reply>& reply) {
+        entry e;
+        e.immutable = !thread_state.used_head && thread_state.newest_block_used <= thread_state.fill_status.irreversible;
+        if (!e.immutable) {
+            auto ttl = ttls.find(target);
+            if (ttl == ttls.end() || ttl->second.count() <= 0)
+                return {};
+            e.expires = std::chrono::steady_clock::now() + ttl->second;
+        }
+        char etag[40];
+        snprintf(
+            etag, sizeof(etag), "\"%016llx-%llx\"", (unsigned long long)std::hash<std::string_view>{}({reply->body().data(), reply->body().size()}),
+            (unsigned long long)reply->body().size());
+        e.body           = reply;
+        e.etag           = etag;
+        e.first          = thread_state.fill_status.first;
+        e.module_version = module_version;
+        entries.put(key, e, 2 * key.size() + reply->body().size() + 256);
+        return e.etag;
+    }
+};
+
+// Modification time of a file, which platforms name differently
+static const struct timespec& file_mtime(const struct stat& st) {
+#ifdef __APPLE__
+    return st.st_mtimespec;
+#else
+    return st.st_mtim;
+#endif
+}
+
+// A file under --wql-static-dir. Small files are read into memory; larger ones only have their headers
+// here and are streamed from disk with http::file_body. Files aren't mapped: they may be edited or
+// truncated while responses still refer to them.
+class static_file : public std::enable_shared_from_this<static_file> {
+  private:
+    mutable std::mutex                         gzip_mutex   = {};
+    mutable bool                               gzip_started = false;
+    mutable std::shared_ptr<const static_file> gzip         = {};
+
+  public:
+    std::vector<char> contents      = {};
+    bool              loaded        = false; // contents hold the whole file
+    size_t            size          = {};
+    struct timespec   mtime         = {};
+    std::string       etag          = {};
+    std::string       last_modified = {};
+
+    static_file()                   = default;
+    static_file(const static_file&) = delete;
+
+    const char* data() const { return contents.data(); }
+
+    // Copy compressed with gzip, or null until it's ready. The first call starts compressing on pool, so
+    // the I/O thread doesn't wait for it. Only for loaded files.
+    std::shared_ptr<const static_file> gzipped(query_pool& pool, int level) const {
+        std::lock_guard<std::mutex> lock{gzip_mutex};
+        if (!gzip_started)
+            gzip_started = pool.try_post([self = shared_from_this(), level] {
+                auto result           = std::make_shared<static_file>();
+                result->contents      = gzip_compress({self->data(), self->data() + self->size}, level);
+                result->loaded        = true;
+                result->size          = result->contents.size();
+                result->mtime         = self->mtime;
+                result->etag          = encoded_etag(self->etag, content_encoding::gzip);
+                result->last_modified = self->last_modified;
+                std::lock_guard<std::mutex> lock{self->gzip_mutex};
+                self->gzip = std::move(result);
+            });
+        return gzip;
+    }
+};
+
+// Body which refers to a loaded static_file
+struct static_file_body {
+    using value_type = std::shared_ptr<const static_file>;
+
+    static std::uint64_t size(const value_type& body) { return body ? body->size : 0; }
+
+    class writer {
+        const value_type& body_;
+
+      public:
+        using const_buffers_type = net::const_buffer;
+
+        template <bool isRequest, class Fields>
+        writer(const http::header<isRequest, Fields>&, const value_type& body)
+            : body_(body) {}
+
+        void init(beast::error_code& ec) { ec = {}; }
+
+        boost::optional<std::pair<const_buffers_type, bool>> get(beast::error_code& ec) {
+            ec = {};
+            if (!body_ || !body_->size)
+                return boost::none;
+            return {{const_buffers_type{body_->data(), body_->size}, false}};
+        }
+    };
+};
+
+// Static files keyed on path. Each request checks the file's size and modification time, so edits show up
+// without a restart. Only files up to max_loaded_size are read into memory.
+class static_file_cache {
+  private:
+    static constexpr size_t max_file_size = 1024 * 1024; // largest file to load, if the cache is big enough
+
+    lru_cache<std::string, std::shared_ptr<const static_file>> files;
+    size_t                                                     max_loaded_size;
+
+    static beast::error_code last_error() { return {errno, boost::system::system_category()}; }
+
+    static bool matches(const static_file& file, const struct stat& st) {
+        auto& mtime = file_mtime(st);
+        return file.size == (size_t)st.st_size && file.mtime.tv_sec == mtime.tv_sec && file.mtime.tv_nsec == mtime.tv_nsec;
+    }
+
+    // Reads path. The size and modification time come from the open file, so a file replaced since the
+    // caller's stat() is read consistently; one which shrinks while being read fails with io_error.
+    static std::shared_ptr<const static_file> load(const std::string& path, beast::error_code& ec) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            ec = last_error();
+            return {};
+        }
+        std::shared_ptr<static_file> file;
+        struct stat                  st;
+        if (::fstat(fd, &st))
+            ec = last_error();
+        else if (!S_ISREG(st.st_mode))
+            ec = make_error_code(beast::errc::no_such_file_or_directory);
+        else {
+            file = describe(st);
+            file->contents.resize(file->size);
+            size_t pos = 0;
+            while (pos < file->size) {
+                auto n = ::pread(fd, file->contents.data() + pos, file->size - pos, pos);
+                if (n < 0 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    ec = n ? last_error() : make_error_code(beast::errc::io_error);
+                    break;
+                }
+                pos += n;
+            }
+            file->loaded = true;
+        }
+        ::close(fd);
+        if (ec)
+            return {};
+        return file;
+    }
+
+  public:
+    explicit static_file_cache(size_t max_bytes)
+        : files(max_bytes)
+        , max_loaded_size(std::min(max_file_size, max_bytes / 8)) {}
+
+    // Headers for the file st describes, without its contents
+    static std::shared_ptr<static_file> describe(const struct stat& st) {
+        auto file   = std::make_shared<static_file>();
+        file->size  = st.st_size;
+        file->mtime = file_mtime(st);
+        char etag[48];
+        snprintf(etag, sizeof(etag), "\"%llx-%llx\"", (unsigned long long)file->size, (unsigned long long)st.st_mtime);
+        file->etag = etag;
+        char      last_modified[40];
+        struct tm tm;
+        gmtime_r(&st.st_mtime, &tm);
+        strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        file->last_modified = last_modified;
+        return file;
+    }
+
+    // Returns path's current headers, and its contents if it's small enough to load. Sets ec and returns
+    // null if it can't.
+    std::shared_ptr<const static_file> get(const std::string& path, beast::error_code& ec) {
+        struct stat st;
+        if (::stat(path.c_str(), &st)) {
+            ec = last_error();
+            return {};
+        }
+        if (!S_ISREG(st.st_mode)) {
+            ec = make_error_code(beast::errc::no_such_file_or_directory);
+            return {};
+        }
+        auto cached = files.get(path);
+        if (cached && matches(**cached, st))
+            return *cached;
+        std::shared_ptr<const static_file> file = (size_t)st.st_size <= max_loaded_size ? load(path, ec) : describe(st);
+        if (file)
+            files.put(path, file, path.size() + file->contents.size() + 256);
+        return file;
+    }
+};
+
+// Counts durations in power-of-two microsecond buckets
+class duration_histogram {
+  public:
+    static constexpr int num_buckets = 32; // bucket i counts durations under 2^i us; the last also counts longer ones
+    using counts                     = std::array<uint64_t, num_buckets>;
+
+  private:
+    std::array<std::atomic<uint64_t>, num_buckets> buckets = {};
+
+  public:
+    void add(std::chrono::steady_clock::duration d) {
+        auto us = std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+        int  i  = 0;
+        while (i < num_buckets - 1 && (1ll << i) <= us)
+            ++i;
+        buckets[i].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // Returns the counts and starts over
+    counts take() {
+        counts result;
+        for (int i = 0; i < num_buckets; ++i)
+            result[i] = buckets[i].exchange(0, std::memory_order_relaxed);
+        return result;
+    }
+
+    // Upper bound, in us, of the bucket holding the given quantile
+    static uint64_t quantile(const counts& c, double q) {
+        uint64_t total = 0;
+        for (auto n : c)
+            total += n;
+        uint64_t seen = 0;
+        for (int i = 0; i < num_buckets; ++i) {
+            seen += c[i];
+            if (seen && seen >= q * total)
+                return 1ull << i;
+        }
+        return 0;
+    }
+};
+
+// Records query_traces. Logs queries slower than a threshold, and every interval logs timing histograms
+// for the queries since the last one.
+class query_tracer : public std::enable_shared_from_this<query_tracer> {
+  private:
+    enum phase { queue_phase, wasm_phase, database_phase, alloc_phase, total_phase, num_phases };
+
+    std::array<duration_histogram, num_phases> phases   = {};
+    std::atomic<uint64_t>                      failures = 0;
+    std::atomic<uint64_t>                      rows     = 0;
+    std::atomic<uint64_t>                      bytes    = 0;
+    std::atomic<uint64_t>                      retries  = 0;
+    std::chrono::steady_clock::duration        slow;
+    std::chrono::seconds                       interval;
+    net::steady_timer                          timer;
+
+    static int64_t us(std::chrono::steady_clock::duration d) { return std::chrono::duration_cast<std::chrono::microseconds>(d).count(); }
+
+    void schedule() {
+        timer.expires_after(interval);
+        timer.async_wait([self = shared_from_this()](beast::error_code ec) {
+            if (ec)
+                return;
+            self->log_histograms();
+            self->schedule();
+        });
+    }
+
+    void log_histograms() {
+        static const char* const names[num_phases] = {"queue", "wasm", "database", "alloc", "total"};
+        std::array<duration_histogram::counts, num_phases> counts;
+        for (int i = 0; i < num_phases; ++i)
+            counts[i] = phases[i].take();
+        uint64_t n = 0;
+        for (auto c : counts[total_phase])
+            n += c;
+        auto num_failures = failures.exchange(0);
+        auto num_rows     = rows.exchange(0);
+        auto num_bytes    = bytes.exchange(0);
+        auto num_retries  = retries.exchange(0);
+        if (!n)
+            return;
+        ilog("queries in the last ${i}s: count=${n} failed=${f} rows=${r} bytes=${b} retries=${t}",
+             ("i", interval.count())("n", n)("f", num_failures)("r", num_rows)("b", num_bytes)("t", num_retries));
+        for (int i = 0; i < num_phases; ++i)
+            ilog("  ${p} us: p50<=${p50} p90<=${p90} p99<=${p99} max<=${max}",
+                 ("p", names[i])("p50", duration_histogram::quantile(counts[i], 0.5))("p90", duration_histogram::quantile(counts[i], 0.9))(
+                     "p99", duration_histogram::quantile(counts[i], 0.99))("max", duration_histogram::quantile(counts[i], 1)));
+    }
+
+  public:
+    // A zero slow or interval disables that part
+    query_tracer(net::io_context& ioc, std::chrono::milliseconds slow, std::chrono::seconds interval)
+        : slow(slow)
+        , interval(interval)
+        , timer(ioc) {}
+
+    void start() {
+        if (interval.count() > 0)
+            schedule();
+    }
+
+    void record(
+        const std::string& target, size_t request_size, std::chrono::steady_clock::duration queued,
+        std::chrono::steady_clock::duration total, const query_trace& trace, size_t reply_size, bool ok) {
+        phases[queue_phase].add(queued);
+        phases[wasm_phase].add(trace.wasm);
+        phases[database_phase].add(trace.database);
+        phases[alloc_phase].add(trace.alloc);
+        phases[total_phase].add(total);
+        if (!ok)
+            failures.fetch_add(1, std::memory_order_relaxed);
+        rows.fetch_add(trace.rows_scanned, std::memory_order_relaxed);
+        bytes.fetch_add(reply_size, std::memory_order_relaxed);
+        retries.fetch_add(trace.retries, std::memory_order_relaxed);
+        if (slow.count() > 0 && queued + total >= slow)
+            wlog("slow query: target=${target} request_bytes=${req} ok=${ok} queue_us=${queue} total_us=${total} wasm_us=${wasm} "
+                 "database_us=${database} alloc_us=${alloc} rows=${rows} reply_bytes=${reply} retries=${retries}",
+                 ("target", target)("req", request_size)("ok", ok)("queue", us(queued))("total", us(total))("wasm", us(trace.wasm))(
+                     "database", us(trace.database))("alloc", us(trace.alloc))("rows", trace.rows_scanned)("reply", reply_size)(
+                     "retries", trace.retries));
+    }
+};
+
+// What wasm-ql reports at /metrics
+class server_metrics {
+  private:
+    struct target_metrics {
+        metrics::counter&   requests;
+        metrics::counter&   failures;
+        metrics::histogram& seconds;
+    };
+
+    // Targets come from clients; past this many, the rest share one label
+    static constexpr size_t max_targets = 64;
+
+    std::mutex                                              mutex   = {};
+    std::map<std::string, std::unique_ptr<target_metrics>> targets = {};
+
+    target_metrics& for_target(const std::string& target) {
+        std::lock_guard<std::mutex> lock{mutex};
+        auto                        it = targets.find(target);
+        if (it != targets.end())
+            return *it->second;
+        auto  label = targets.size() < max_targets ? target : "other"s;
+        auto& m     = targets[label];
+        if (!m) {
+            metrics::labels l{{"target", label}};
+            m = std::make_unique<target_metrics>(target_metrics{
+                registry->get_counter("wasmql_requests_total", "Queries run, by target", l),
+                registry->get_counter("wasmql_request_failures_total", "Queries which failed, by target", l),
+                registry->get_histogram("wasmql_request_seconds", "Time to run queries, by target", metrics::latency_bounds(), l),
+            });
+        }
+        return *m;
+    }
+
+  public:
+    std::shared_ptr<metrics::registry> registry = std::make_shared<metrics::registry>();
+    metrics::gauge&                    http_sessions;
+    metrics::gauge&                    websocket_sessions;
+    metrics::counter&                  rejected;
+    metrics::counter&                  throttled;
+    metrics::histogram&                queue_seconds;
+    metrics::histogram&                wasm_seconds;
+    metrics::histogram&                database_seconds;
+    metrics::histogram&                rows_scanned;
+
+    server_metrics(
+        const std::shared_ptr<const shared_state>& state, const std::shared_ptr<query_pool>& pool,
+        const std::shared_ptr<response_cache>& responses)
+        : http_sessions(registry->get_gauge("wasmql_http_sessions", "Open HTTP connections"))
+        , websocket_sessions(registry->get_gauge("wasmql_websocket_sessions", "Open WebSocket connections"))
+        , rejected(registry->get_counter("wasmql_rejected_total", "Queries turned away because the queue was full"))
+        , throttled(registry->get_counter("wasmql_throttled_total", "Queries turned away by a rate limit"))
+        , queue_seconds(registry->get_histogram("wasmql_queue_seconds", "Time queries waited for a thread", metrics::latency_bounds()))
+        , wasm_seconds(registry->get_histogram("wasmql_wasm_seconds", "Time queries spent running WASM", metrics::latency_bounds()))
+        , database_seconds(
+              registry->get_histogram("wasmql_database_seconds", "Time queries spent in the database", metrics::latency_bounds()))
+        , rows_scanned(registry->get_histogram("wasmql_rows_scanned", "Rows each query scanned", metrics::size_bounds())) {
+
+        auto& queue_depth = registry->get_gauge("wasmql_queue_depth", "Queries waiting for a thread");
+        registry->on_collect([&queue_depth, pool] { queue_depth.set(pool->queued()); });
+        if (responses) {
+            auto& hits   = registry->get_counter("wasmql_response_cache_hits_total", "Requests answered from the response cache");
+            auto& misses = registry->get_counter("wasmql_response_cache_misses_total", "Requests the response cache couldn't answer");
+            registry->on_collect([&hits, &misses, responses] {
+                hits.set(responses->get_hits());
+                misses.set(responses->get_misses());
+            });
+        }
+        state->db_iface->register_metrics(*registry);
+        if (auto results = state->db_iface->result_cache) {
+            auto& hits   = registry->get_counter("wasmql_query_cache_hits_total", "query_database results found in the query cache");
+            auto& misses = registry->get_counter("wasmql_query_cache_misses_total", "Cacheable query_database results not in the query cache");
+            registry->on_collect([&hits, &misses, results] {
+                hits.set(results->get_hits());
+                misses.set(results->get_misses());
+            });
+        }
+    }
+
+    void record(
+        const std::string& target, std::chrono::steady_clock::duration queued, std::chrono::steady_clock::duration total,
+        const query_trace& trace, bool ok) {
+        auto  seconds = [](auto d) { return std::chrono::duration<double>(d).count(); };
+        auto& t       = for_target(target);
+        t.requests.add();
+        if (!ok)
+            t.failures.add();
+        t.seconds.observe(seconds(total));
+        queue_seconds.observe(seconds(queued));
+        wasm_seconds.observe(seconds(trace.wasm));
+        database_seconds.observe(seconds(trace.database));
+        rows_scanned.observe(trace.rows_scanned);
+    }
+};
+
+// Identifies a query to query_tracer and server_metrics
+struct trace_label {
+    std::shared_ptr<query_tracer>   tracer       = {}; // null if tracing is off
+    std::shared_ptr<server_metrics> metrics      = {}; // null if metrics are off
+    std::string                     target       = {};
+    size_t                          request_size = {};
+};
+
+// Where a query's response goes in the response cache
+struct cache_slot {
+    std::shared_ptr<response_cache> cache          = {};
+    std::string                     target         = {};
+    std::string                     key            = {};
+    uint64_t                        module_version = {};
+};
+
+// What one request needs from a reply
+struct reply_format {
+    unsigned         version       = {};
+    bool             keep_alive    = {};
+    std::string      if_none_match = {};
+    content_encoding encoding      = content_encoding::identity; // best one the client accepts
+};
+
+// Result of running a query, shared by every request coalesced onto it
+struct query_outcome {
+    std::shared_ptr<encoded_reply> reply  = {};
+    std::string                    etag   = {}; // of the identity encoding
+    http::status                   status = http::status::ok;
+    std::string                    error  = {}; // response body if status isn't ok
+};
+
+class response_stream;
+
+// A session waiting for a query's reply. Query threads call these.
+struct reply_target {
+    virtual ~reply_target() {}
+
+    // Sends a complete reply
+    virtual void deliver(const reply_format& format, const query_outcome& outcome) = 0;
+
+    // Sends a streamed reply instead: begin_stream(), any number of stream_chunk(), then end_stream(). Each
+    // chunk's size must be passed to stream.release() once it's written or dropped.
+    virtual void begin_stream(const reply_format& format, const std::shared_ptr<response_stream>& stream) = 0;
+    virtual void stream_chunk(const std::shared_ptr<const std::vector<char>>& chunk)                     = 0;
+    virtual void end_stream(bool ok)                                                                      = 0;
+};
+
+// One request waiting for a query's reply
+struct query_waiter {
+    std::shared_ptr<reply_target> target = {};
+    reply_format                  format = {};
+};
+
+// Token buckets, keyed by client address or target. Each bucket earns rate tokens per second, holding at most
+// burst, and each request spends one.
+class rate_limiter {
+  private:
+    struct bucket {
+        std::string                           key     = {};
+        double                                rate    = {};
+        double                                burst   = {};
+        double                                tokens  = {};
+        std::chrono::steady_clock::time_point updated = {};
+
+        void refill(std::chrono::steady_clock::time_point now) {
+            tokens  = std::min(burst, tokens + std::chrono::duration<double>(now - updated).count() * rate);
+            updated = now;
+        }
+    };
+
+    // Beyond this, the least-recently used bucket is dropped for each new one. A dropped bucket comes back
+    // full, which only favours keys idle while this many others were active.
+    static constexpr size_t max_buckets = 100'000;
+
+    std::mutex                                                   mutex   = {};
+    std::list<bucket>                                            buckets = {}; // most-recently used first
+    std::unordered_map<std::string, std::list<bucket>::iterator> index   = {};
+
+  public:
+    // Spends a token from key's bucket. Returns false if it's empty.
+    bool try_take(const std::string& key, double rate, double burst) {
+        auto                        now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock{mutex};
+        auto                        it = index.find(key);
+        if (it == index.end()) {
+            if (buckets.size() >= max_buckets) {
+                index.erase(buckets.back().key);
+                buckets.pop_back();
+            }
+            buckets.push_front(bucket{key, rate, burst, burst, now});
+            it = index.emplace(key, buckets.begin()).first;
+        } else {
+            buckets.splice(buckets.begin(), buckets, it->second);
+            it->second->refill(now);
+        }
+        auto& b = *it->second;
+        if (b.tokens < 1)
+            return false;
+        b.tokens -= 1;
+        return true;
+    }
+};
+
+// Single-flight for queries: while a query runs, byte-identical requests against the same head attach to
+// it instead of running again.
+class query_coalescer {
+  private:
+    std::mutex                                                 mutex   = {};
+    std::unordered_map<std::string, std::vector<query_waiter>> flights = {};
+
+  public:
+    static std::string key(beast::string_view target, const std::vector<char>& body, const fill_status_snapshot& snapshot) {
+        std::string result(target.data(), target.size());
+        result.push_back(0);
+        result.append(reinterpret_cast<const char*>(&snapshot.status.head), sizeof(snapshot.status.head));
+        result.append(reinterpret_cast<const char*>(&snapshot.fork_generation), sizeof(snapshot.fork_generation));
+        result.append(body.begin(), body.end());
+        return result;
+    }
+
+    // Attaches waiter to the running query for key and returns true. If there isn't one, starts tracking
+    // key and returns false; the caller must run the query, then call finish().
+    bool join(const std::string& key, query_waiter waiter) {
+        std::lock_guard<std::mutex> lock{mutex};
+        auto                        it = flights.find(key);
+        if (it == flights.end()) {
+            flights[key];
+            return false;
+        }
+        it->second.push_back(std::move(waiter));
+        return true;
+    }
+
+    // Stops tracking key. Returns the requests which attached to it.
+    std::vector<query_waiter> finish(const std::string& key) {
+        std::lock_guard<std::mutex> lock{mutex};
+        auto                        it     = flights.find(key);
+        auto                        result = std::move(it->second);
+        flights.erase(it);
+        return result;
+    }
+};
+
+// Sends one query's reply, in chunks, to every request waiting for it. Once streaming starts, new identical
+// requests run the query themselves. write() blocks while too much is queued for sending, so a slow
+// client holds back its query instead of growing server memory, until the request's deadline.
+class response_stream : public output_stream, public std::enable_shared_from_this<response_stream> {
+  private:
+    static constexpr size_t max_chunks_in_flight = 4; // per target
+
+    std::mutex                       mutex;
+    std::condition_variable          cv;
+    size_t                           chunk_size_;
+    query_waiter                     leader;
+    std::shared_ptr<query_coalescer> coalescer;
+    std::string                      key;
+    std::vector<query_waiter>        targets   = {}; // filled when streaming starts
+    std::atomic<bool>                started_  = false;
+    size_t                           in_flight = 0; // bytes passed to targets which they haven't released
+
+  public:
+    response_stream(size_t chunk_size, query_waiter leader, std::shared_ptr<query_coalescer> coalescer, std::string key)
+        : chunk_size_(chunk_size)
+        , leader(std::move(leader))
+        , coalescer(std::move(coalescer))
+        , key(std::move(key)) {}
+
+    size_t chunk_size() const override { return chunk_size_; }
+    bool   started() const override { return started_; }
+
+    void write(std::vector<char> chunk, std::chrono::steady_clock::time_point deadline) override {
+        if (!started_) {
+            targets.push_back(leader);
+            for (auto& w : coalescer->finish(key))
+                targets.push_back(std::move(w));
+            started_ = true;
+            for (auto& t : targets)
+                t.target->begin_stream(t.format, shared_from_this());
+        }
+        auto shared = std::make_shared<const std::vector<char>>(std::move(chunk));
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            in_flight += shared->size() * targets.size();
+        }
+        for (auto& t : targets)
+            t.target->stream_chunk(shared);
+        std::unique_lock<std::mutex> lock{mutex};
+        auto                         room = [&] { return in_flight <= max_chunks_in_flight * chunk_size_ * targets.size(); };
+        if (deadline == std::chrono::steady_clock::time_point::max())
+            cv.wait(lock, room);
+        else if (!cv.wait_until(lock, deadline, room))
+            throw query_error(504, "query timed out waiting for clients to read its reply");
+    }
+
+    void release(size_t size) {
+        std::lock_guard<std::mutex> lock{mutex};
+        in_flight -= size;
+        cv.notify_all();
+    }
+
+    // Finishes the reply. If !ok, targets close their connections since the reply can't be completed.
+    void end(bool ok) {
+        for (auto& t : targets)
+            t.target->end_stream(ok);
+    }
+};
+
+// A connection receiving subscription results
+struct subscription_target {
+    virtual ~subscription_target() {}
+
+    // Sends the result of subscription id as of head. Called on any thread.
+    virtual void push(uint32_t id, uint32_t head, const std::shared_ptr<const std::vector<char>>& result) = 0;
+};
+
+// Queries which clients subscribed to over /wasmql/v1/subscribe. Each distinct query runs once per head
+// block, however many connections subscribed to it, and its result is pushed only when it changes.
+class subscription_registry : public std::enable_shared_from_this<subscription_registry> {
+  private:
+    struct subscriber {
+        std::weak_ptr<subscription_target> target = {};
+        uint32_t                           id     = {};
+    };
+
+    struct entry {
+        std::vector<char>                        request         = {}; // one sub-request, as /wasmql/v1/query takes it
+        std::vector<subscriber>                  subscribers     = {};
+        std::shared_ptr<const std::vector<char>> result          = {}; // last one pushed
+        uint32_t                                 head            = {}; // when last evaluated
+        uint64_t                                 fork_generation = {}; // when last evaluated
+        bool                                     running         = false;
+    };
+
+    std::mutex                                    mutex           = {}; // protects entries, their contents and num_subscribers
+    std::map<std::string, std::shared_ptr<entry>> entries         = {};
+    size_t                                        num_subscribers = 0; // across entries, including ones whose targets are gone
+    size_t                                        max_subscribers;
+    net::steady_timer                             timer;
+    std::chrono::milliseconds                     interval;
+    std::shared_ptr<const shared_state>           state;
+    std::shared_ptr<query_pool>                   pool;
+    std::shared_ptr<thread_state_cache>           state_cache;
+
+    // Returns the database status, encoded as get_database_status() returns it
+    static std::vector<char> encode_status(const state_history::fill_status& status) {
+        std::vector<char> result;
+        abieos::native_to_bin(status.head, result);
+        abieos::native_to_bin(status.head_id, result);
+        abieos::native_to_bin(status.irreversible, result);
+        abieos::native_to_bin(status.irreversible_id, result);
+        abieos::native_to_bin(status.first, result);
+        return result;
+    }
+
+    // Each tick runs check() on the query pool, since getting the fill status may wait on the database. The
+    // next tick is scheduled once it's done. If the pool's queue is full, the tick is skipped.
+    void schedule() {
+        timer.expires_after(interval);
+        timer.async_wait([self = shared_from_this()](beast::error_code ec) {
+            if (ec)
+                return;
+            bool posted = self->pool->try_post([self] {
+                auto next = fc::make_scoped_exit([&] { net::post(self->timer.get_executor(), [self] { self->schedule(); }); });
+                self->check();
+            });
+            if (!posted)
+                self->schedule();
+        });
+    }
+
+    // Starts evaluating every entry which hasn't seen the current head. Drops entries nobody listens to.
+    void check() {
+        auto                        snapshot = state->fill_status->get();
+        std::lock_guard<std::mutex> lock{mutex};
+        for (auto it = entries.begin(); it != entries.end();) {
+            auto& e    = *it->second;
+            auto  size = e.subscribers.size();
+            e.subscribers.erase(
+                std::remove_if(e.subscribers.begin(), e.subscribers.end(), [](auto& s) { return s.target.expired(); }), e.subscribers.end());
+            num_subscribers -= size - e.subscribers.size();
+            if (e.subscribers.empty() && !e.running) {
+                it = entries.erase(it);
+                continue;
+            }
+            if (!e.running && (e.head != snapshot->status.head || e.fork_generation != snapshot->fork_generation))
+                evaluate(it->second, snapshot);
+            ++it;
+        }
+    }
+
+    // Runs an entry's query on the pool. If the pool is busy, the next check() tries again.
+    void evaluate(const std::shared_ptr<entry>& e, const std::shared_ptr<const fill_status_snapshot>& snapshot) {
+        e->running = true;
+        bool posted = pool->try_post([self = shared_from_this(), e, snapshot] {
+            auto                                     head            = snapshot->status.head;
+            auto                                     fork_generation = snapshot->fork_generation;
+            std::shared_ptr<const std::vector<char>> result;
+            try {
+                if (e->request.empty()) {
+                    result = std::make_shared<const std::vector<char>>(encode_status(snapshot->status));
+                } else {
+                    auto thread_state      = self->state_cache->get_state();
+                    thread_state->deadline = thread_state->shared->deadline_after(std::chrono::steady_clock::now());
+                    auto reply             = query(*thread_state, e->request);
+                    head                   = thread_state->fill_status.head;
+                    fork_generation        = thread_state->fork_generation;
+                    self->state_cache->store_state(std::move(thread_state));
+
+                    // Unwrap the single reply
+                    abieos::input_buffer bin{reply.data(), reply.data() + reply.size()};
+                    abieos::bin_to_native<abieos::varuint32>(bin);
+                    auto sub_reply = abieos::bin_to_native<abieos::input_buffer>(bin);
+                    result         = std::make_shared<const std::vector<char>>(sub_reply.pos, sub_reply.end);
+                }
+            } catch (const std::exception& ex) {
+                elog("subscription query failed: ${s}", ("s", ex.what()));
+            } catch (...) {
+                elog("subscription query failed: unknown exception");
+            }
+            self->finish(*e, head, fork_generation, result);
+        });
+        if (!posted)
+            e->running = false;
+    }
+
+    void finish(entry& e, uint32_t head, uint64_t fork_generation, const std::shared_ptr<const std::vector<char>>& result) {
+        std::vector<subscriber> subscribers;
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            e.running         = false;
+            e.head            = head;
+            e.fork_generation = fork_generation;
+            if (!result || (e.result && *e.result == *result))
+                return;
+            e.result    = result;
+            subscribers = e.subscribers;
+        }
+        for (auto& s : subscribers)
+            if (auto target = s.target.lock())
+                target->push(s.id, head, result);
+    }
+
+  public:
+    subscription_registry(
+        net::io_context& ioc, std::chrono::milliseconds interval, size_t max_subscribers, std::shared_ptr<const shared_state> state,
+        std::shared_ptr<query_pool> pool, std::shared_ptr<thread_state_cache> state_cache)
+        : max_subscribers(max_subscribers)
+        , timer(ioc)
+        , interval(interval)
+        , state(std::move(state))
+        , pool(std::move(pool))
+        , state_cache(std::move(state_cache)) {}
+
+    void start() { schedule(); }
+
+    // Subscribes target to a query. request is one sub-request's payload, as a client WASM creates it, or
+    // empty to follow the database status. target gets the current result right away if there is one.
+    // Returns false if the server already has max_subscribers subscriptions.
+    bool subscribe(const std::vector<char>& request, const std::shared_ptr<subscription_target>& target, uint32_t id) {
+        std::string                              key(request.begin(), request.end());
+        std::shared_ptr<const std::vector<char>> result;
+        uint32_t                                 head = 0;
+        {
+            std::lock_guard<std::mutex> lock{mutex};
+            if (num_subscribers >= max_subscribers)
+                return false;
+            ++num_subscribers;
+            auto& e = entries[key];
+            if (!e) {
+                e = std::make_shared<entry>();
+                if (!request.empty()) {
+                    abieos::push_varuint32(e->request, 1);
+                    abieos::push_varuint32(e->request, request.size());
+                    e->request.insert(e->request.end(), request.begin(), request.end());
+                }
+            }
+            e->subscribers.push_back({target, id});
+            result = e->result;
+            head   = e->head;
+        }
+        if (result)
+            target->push(id, head, result);
+        return true;
+    }
+};
+
+// State shared by the listener and every session
+struct server_context {
+    std::string                            doc_root          = {};
+    std::shared_ptr<const shared_state>    state             = {};
+    std::shared_ptr<query_pool>            pool              = {};
+    std::shared_ptr<thread_state_cache>    state_cache       = {};
+    std::shared_ptr<response_cache>        responses         = {}; // null if disabled
+    std::shared_ptr<query_coalescer>       coalescer         = {};
+    size_t                                 compress_min_size = {}; // smallest reply to compress; 0 disables compression
+    int                                    compress_level    = {};
+    size_t                                 stream_chunk_size = {}; // 0 disables streaming
+    std::shared_ptr<subscription_registry> subscriptions     = {}; // null if disabled
+    uint32_t                               max_subscriptions = {}; // per connection
+    std::shared_ptr<static_file_cache>     static_files      = {}; // null if doc_root is empty
+    std::shared_ptr<query_tracer>          tracer            = {}; // null if disabled
+    std::shared_ptr<server_metrics>        metrics           = {}; // null if disabled
+    std::shared_ptr<rate_limiter>          rate_limits       = {}; // null if no rate limits are set
+    double                                 client_rate       = {}; // requests per second per client address; 0 is unlimited
+    std::map<std::string, double>          target_rates      = {}; // requests per second per target, from all clients
+    double                                 rate_burst        = {}; // seconds of requests a bucket can save up
+
+    // Encoding to send a reply of size bytes in, given the best one the client accepts
+    content_encoding encoding_for(content_encoding accepted, size_t size) const {
+        if (!compress_min_size || size < compress_min_size)
+            return content_encoding::identity;
+        return accepted;
+    }
+};
+
+// Returns an error response
+static http::response<http::string_body> error_response(unsigned version, bool keep_alive, http::status status, beast::string_view why) {
+    http::response<http::string_body> res{status, version};
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.set(http::field::content_type, "text/html");
+    res.keep_alive(keep_alive);
+    res.body() = why.to_string();
+    res.prepare_payload();
+    return res;
+}
+
+// Returns a query result
+static http::response<shared_vector_body> ok_response(
+    const reply_format& format, const shared_state& shared_state, std::shared_ptr<const std::vector<char>> reply, const char* content_type,
+    const std::string& etag, content_encoding encoding) {
+    http::response<shared_vector_body> res{http::status::ok, format.version};
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    res.set(http::field::content_type, content_type);
+    if (!shared_state.allow_origin.empty())
+        res.set(http::field::access_control_allow_origin, shared_state.allow_origin);
+    if (!etag.empty())
+        res.set(http::field::etag, etag);
+    if (encoding != content_encoding::identity)
+        res.set(http::field::content_encoding, to_string(encoding));
+    res.set(http::field::vary, "Accept-Encoding");
+    res.keep_alive(format.keep_alive);
+    res.body() = std::move(reply);
+    res.prepare_payload();
+    return res;
+}
+
+// Returns a 304 for a client which already has the response tagged etag
+static http::response<http::empty_body>
+not_modified_response(const reply_format& format, const shared_state& shared_state, const std::string& etag) {
+    http::response<http::empty_body> res{http::status::not_modified, format.version};
+    res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+    if (!shared_state.allow_origin.empty())
+        res.set(http::field::access_control_allow_origin, shared_state.allow_origin);
+    res.set(http::field::etag, etag);
+    res.set(http::field::vary, "Accept-Encoding");
+    res.keep_alive(format.keep_alive);
+    return res;
+}
+
+// Runs f on a query thread then passes the outcome to deliver. If stream is set, f may send its reply there
+// instead, and deliver isn't called. Returns false if the pool's queue is full.
+template <class F, class Deliver>
+bool post_query(
+    query_pool& pool, const std::shared_ptr<thread_state_cache>& state_cache, cache_slot slot, trace_label label,
+    std::shared_ptr<response_stream> stream, F f, Deliver deliver) {
+    auto posted = std::chrono::steady_clock::now();
+    return pool.try_post([=]() mutable {
+        auto          started    = std::chrono::steady_clock::now();
+        auto          finished   = started;
+        query_outcome outcome;
+        query_trace   trace;
+        size_t        reply_size = 0;
+        auto          record     = fc::make_scoped_exit([&] {
+            bool ok = outcome.status == http::status::ok;
+            if (label.tracer)
+                label.tracer->record(label.target, label.request_size, started - posted, finished - started, trace, reply_size, ok);
+            if (label.metrics)
+                label.metrics->record(label.target, started - posted, finished - started, trace, ok);
+        });
+        try {
+            auto thread_state      = state_cache->get_state();
+            thread_state->stream   = stream.get();
+            thread_state->trace    = {};
+            thread_state->deadline = thread_state->shared->deadline_after(posted);
+            std::vector<char> reply;
+            {
+                auto keep_trace = fc::make_scoped_exit([&] {
+                    finished = std::chrono::steady_clock::now();
+                    trace    = thread_state->trace;
+                });
+                reply = f(*thread_state);
+            }
+            thread_state->stream = nullptr;
+            reply_size           = trace.bytes_streamed + reply.size();
+            if (stream && stream->started()) {
+                auto deadline = thread_state->deadline;
+                state_cache->store_state(std::move(thread_state));
+                if (!reply.empty())
+                    stream->write(std::move(reply), deadline);
+                return stream->end(true);
+            }
+            outcome.reply = std::make_shared<encoded_reply>(std::move(reply));
+            if (slot.cache)
+                outcome.etag = slot.cache->put(slot.target, slot.key, slot.module_version, *thread_state, outcome.reply);
+            state_cache->store_state(std::move(thread_state));
+        } catch (const query_error& e) {
+            outcome.status = http::status(e.status);
+            outcome.error  = e.what() + "\n"s;
+        } catch (const std::exception& e) {
+            elog("query failed: ${s}", ("s", e.what()));
+            outcome.status = http::status::internal_server_error;
+            outcome.error  = "query failed: "s + e.what() + "\n";
+        } catch (...) {
+            elog("query failed: unknown exception");
+            outcome.status = http::status::internal_server_error;
+            outcome.error  = "query failed: unknown exception\n";
+        }
+        if (stream && stream->started())
+            return stream->end(false);
+        deliver(outcome);
+    });
+}
+
+// Sends reply to one request, compressing it first if the client and configuration allow. Compression
+// makes this slow; only call it on query threads.
+template <class Session>
+void send_reply(Session& session, const server_context& context, const reply_format& format, encoded_reply& reply, const std::string& etag) {
+    auto encoding = context.encoding_for(format.encoding, reply.body().size());
+    auto tag      = encoded_etag(etag, encoding);
+    if (!tag.empty() && tag == format.if_none_match)
+        return session.send_query_response(not_modified_response(format, *context.state, tag));
+    session.send_query_response(
+        ok_response(format, *context.state, reply.get(encoding, context.compress_level), "application/octet-stream", tag, encoding));
+}
+
 // This function produces an HTTP response for the given
 // request. The type of the response object depends on the
 // contents of the request, so the interface requires the
 // caller to pass a generic lambda for receiving the response.
-template <class Body, class Allocator, class Send>
+//
+// Queries run on the query pool; their responses arrive later through the
+// session's reply_target interface. Identical concurrent queries share one run.
+template <class Body, class Allocator, class Send, class Session>
 void handle_request(
-    beast::string_view doc_root, const std::shared_ptr<const shared_state>& shared_state,
-    const std::shared_ptr<thread_state_cache>& state_cache, http::request<Body, http::basic_fields<Allocator>>&& req, Send&& send) {
+    const std::shared_ptr<const server_context>& context_ptr, http::request<Body, http::basic_fields<Allocator>>&& req, Send&& send,
+    const std::shared_ptr<Session>& session) {
+    const auto& context      = *context_ptr;
+    const auto& doc_root     = context.doc_root;
+    const auto& shared_state = context.state;
+    const auto  accepted     = negotiate_encoding(req[http::field::accept_encoding]);
+
     // Returns a bad request response
     const auto bad_request = [&req](beast::string_view why) {
         http::response<http::string_body> res{http::status::bad_request, req.version()};
@@ -181,42 +1299,115 @@ void handle_request(
 
     // Returns an error response
     const auto error = [&req](http::status status, beast::string_view why) {
-        http::response<http::string_body> res{status, req.version()};
-        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-        res.set(http::field::content_type, "text/html");
-        res.keep_alive(req.keep_alive());
-        res.body() = why.to_string();
-        res.prepare_payload();
-        return res;
+        return error_response(req.version(), req.keep_alive(), status, why);
     };
 
-    const auto ok = [&shared_state, &req](std::vector<char> reply, const char* content_type) {
-        http::response<http::vector_body<char>> res{http::status::ok, req.version()};
-        res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-        res.set(http::field::content_type, content_type);
-        if (!shared_state->allow_origin.empty())
-            res.set(http::field::access_control_allow_origin, shared_state->allow_origin);
-        res.keep_alive(req.keep_alive());
-        res.body() = std::move(reply);
-        res.prepare_payload();
-        return res;
+    // Spends a token from the client's and the target's buckets. Returns false, after sending a 429, if either is empty.
+    const auto check_rate = [&] {
+        if (!context.rate_limits)
+            return true;
+        auto target = req.target().to_string();
+        auto it     = context.target_rates.find(target);
+        auto refuse = [&](double rate) {
+            if (context.metrics)
+                context.metrics->throttled.add();
+            auto res = error(http::status::too_many_requests, "too many requests\n");
+            res.set(http::field::retry_after, std::to_string((unsigned)std::ceil(1 / rate)));
+            send(std::move(res));
+            return false;
+        };
+        auto burst  = [&](double rate) { return std::max(1.0, rate * context.rate_burst); };
+        if (context.client_rate && !session->client().empty() &&
+            !context.rate_limits->try_take("client " + session->client(), context.client_rate, burst(context.client_rate)))
+            return refuse(context.client_rate);
+        if (it != context.target_rates.end() && !context.rate_limits->try_take("target " + target, it->second, burst(it->second)))
+            return refuse(it->second);
+        return true;
+    };
+
+    // Answers from the response cache if possible. Otherwise runs f(thread_state, body) on the query pool,
+    // or attaches to an identical query which is already running. Rejects the request if the pool is saturated.
+    // If streamable, the reply may be sent in chunks while the query runs.
+    const auto run_query = [&](bool streamable, auto f) {
+        if (!check_rate())
+            return;
+        auto         snapshot = shared_state->fill_status->get();
+        reply_format format{req.version(), req.keep_alive(), req[http::field::if_none_match].to_string(), accepted};
+        cache_slot   slot;
+        if (context.responses) {
+            slot.cache          = context.responses;
+            slot.target         = req.target().to_string();
+            slot.key            = response_cache::key(req.target(), req.body());
+            slot.module_version = shared_state->modules->get_version();
+            if (auto hit = context.responses->get(slot.key, snapshot->status.first, slot.module_version)) {
+                auto encoding = context.encoding_for(accepted, hit->body->body().size());
+                auto tag      = encoded_etag(hit->etag, encoding);
+                if (!tag.empty() && tag == format.if_none_match)
+                    return send(not_modified_response(format, *shared_state, tag));
+                if (auto body = hit->body->find(encoding))
+                    return send(ok_response(format, *shared_state, body, "application/octet-stream", tag, encoding));
+
+                // Nothing has compressed this reply for this encoding yet; do it on a query thread
+                session->begin_query();
+                bool posted = context.pool->try_post([session, context_ptr, format, hit = std::move(*hit)] {
+                    send_reply(*session, *context_ptr, format, *hit.body, hit.etag);
+                });
+                if (!posted) {
+                    if (context.metrics)
+                        context.metrics->rejected.add();
+                    session->send_query_response(error(http::status::service_unavailable, "too many queued requests\n"));
+                }
+                return;
+            }
+        }
+
+        query_waiter waiter{session, format};
+        auto         key = query_coalescer::key(req.target(), req.body(), *snapshot);
+        session->begin_query();
+        if (context.coalescer->join(key, waiter))
+            return;
+
+        std::shared_ptr<response_stream> stream;
+        if (streamable && context.stream_chunk_size && req.version() >= 11)
+            stream = std::make_shared<response_stream>(context.stream_chunk_size, waiter, context.coalescer, key);
+        auto deliver = [coalescer = context.coalescer, key, waiter](const query_outcome& outcome) {
+            waiter.target->deliver(waiter.format, outcome);
+            for (auto& w : coalescer->finish(key))
+                w.target->deliver(w.format, outcome);
+        };
+        // The label needs the body's size before run takes the body
+        trace_label label{context.tracer, context.metrics, req.target().to_string(), req.body().size()};
+        auto        run = [f = std::move(f), body = std::move(req.body())](thread_state& thread_state) {
+            return f(thread_state, body);
+        };
+        if (!post_query(*context.pool, context.state_cache, std::move(slot), std::move(label), std::move(stream), std::move(run), deliver)) {
+            if (context.metrics)
+                context.metrics->rejected.add();
+            deliver(query_outcome{{}, {}, http::status::service_unavailable, "too many queued requests\n"});
+        }
     };
 
     try {
         if (req.target() == "/wasmql/v1/query") {
             if (req.method() != http::verb::post)
                 return send(error(http::status::bad_request, "Unsupported HTTP-method for " + req.target().to_string() + "\n"));
-            auto thread_state = state_cache->get_state();
-            send(ok(query(*thread_state, req.body()), "application/octet-stream"));
-            state_cache->store_state(std::move(thread_state));
-            return;
+            return run_query(false, [](thread_state& thread_state, const std::vector<char>& body) { return query(thread_state, body); });
         } else if (req.target().starts_with("/v1/")) {
             if (req.method() != http::verb::post)
                 return send(error(http::status::bad_request, "Unsupported HTTP-method for " + req.target().to_string() + "\n"));
-            auto thread_state = state_cache->get_state();
-            send(ok(legacy_query(*thread_state, req.target().to_string(), req.body()), "application/octet-stream"));
-            state_cache->store_state(std::move(thread_state));
-            return;
+            return run_query(true, [target = req.target().to_string()](thread_state& thread_state, const std::vector<char>& body) {
+                return legacy_query(thread_state, target, body);
+            });
+        } else if (req.target() == "/metrics" && context.metrics) {
+            if (req.method() != http::verb::get)
+                return send(error(http::status::bad_request, "Unsupported HTTP-method for " + req.target().to_string() + "\n"));
+            http::response<http::string_body> res{http::status::ok, req.version()};
+            res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+            res.set(http::field::content_type, metrics::content_type);
+            res.keep_alive(req.keep_alive());
+            res.body() = context.metrics->registry->render();
+            res.prepare_payload();
+            return send(std::move(res));
         } else if (doc_root.empty()) {
             return send(error(http::status::not_found, "The resource '" + req.target().to_string() + "' was not found.\n"));
         } else {
@@ -233,39 +1424,96 @@ void handle_request(
             if (req.target().back() == '/')
                 path.append("index.html");
 
-            // Attempt to open the file
-            beast::error_code           ec;
-            http::file_body::value_type body;
-            body.open(path.c_str(), beast::file_mode::scan, ec);
+            // Prefer a precompressed copy (path + ".gz") if the client accepts gzip. Otherwise compress loaded text
+            // files once a query thread has done so.
+            beast::error_code                  ec;
+            std::shared_ptr<const static_file> file;
+            std::string                        file_path = path;
+            bool                               gzipped   = false;
+            if (accepted == content_encoding::gzip) {
+                file    = context.static_files->get(path + ".gz", ec);
+                gzipped = !!file;
+                ec      = {};
+                if (gzipped)
+                    file_path = path + ".gz";
+            }
+            if (!file)
+                file = context.static_files->get(path, ec);
 
             // Handle the case where the file doesn't exist
-            if (ec == beast::errc::no_such_file_or_directory)
+            if (ec == beast::errc::no_such_file_or_directory || ec == beast::errc::not_a_directory)
                 return send(not_found(req.target()));
 
             // Handle an unknown error
             if (ec)
                 return send(error(http::status::internal_server_error, "An error occurred: "s + ec.message()));
 
-            // Cache the size since we need it after the move
-            const auto size = body.size();
+            if (!gzipped && file->loaded && compressible(mime_type(path)) &&
+                context.encoding_for(accepted, file->size) == content_encoding::gzip) {
+                if (auto compressed = file->gzipped(*context.pool, context.compress_level)) {
+                    file    = std::move(compressed);
+                    gzipped = true;
+                }
+            }
+
+            // Sets the headers shared by every response for this file
+            const auto set_headers = [&](auto& res) {
+                res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+                res.set(http::field::etag, file->etag);
+                res.set(http::field::last_modified, file->last_modified);
+                res.set(http::field::vary, "Accept-Encoding");
+                res.keep_alive(req.keep_alive());
+            };
+
+            // The client's copy is current
+            auto if_none_match = req[http::field::if_none_match];
+            if (if_none_match.empty() ? req[http::field::if_modified_since] == file->last_modified
+                                      : if_none_match.find(file->etag) != beast::string_view::npos) {
+                http::response<http::empty_body> res{http::status::not_modified, req.version()};
+                set_headers(res);
+                return send(std::move(res));
+            }
 
             // Respond to HEAD request
             if (req.method() == http::verb::head) {
                 http::response<http::empty_body> res{http::status::ok, req.version()};
-                res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+                set_headers(res);
                 res.set(http::field::content_type, mime_type(path));
-                res.content_length(size);
-                res.keep_alive(req.keep_alive());
+                if (gzipped)
+                    res.set(http::field::content_encoding, "gzip");
+                res.content_length(file->size);
                 return send(std::move(res));
             }
 
-            // Respond to GET request
-            http::response<http::file_body> res{std::piecewise_construct, std::make_tuple(std::move(body)),
-                                                std::make_tuple(http::status::ok, req.version())};
-            res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+            // Respond to GET request. Files too big to load are streamed from disk; their headers describe the
+            // file actually opened, in case it changed since get().
+            if (!file->loaded) {
+                http::file_body::value_type body;
+                body.open(file_path.c_str(), beast::file_mode::scan, ec);
+                struct stat st;
+                if (!ec && ::fstat(body.file().native_handle(), &st))
+                    ec = {errno, boost::system::system_category()};
+                if (ec == beast::errc::no_such_file_or_directory)
+                    return send(not_found(req.target()));
+                if (ec)
+                    return send(error(http::status::internal_server_error, "An error occurred: "s + ec.message()));
+                file = static_file_cache::describe(st);
+                http::response<http::file_body> res{
+                    std::piecewise_construct, std::make_tuple(std::move(body)), std::make_tuple(http::status::ok, req.version())};
+                set_headers(res);
+                res.set(http::field::content_type, mime_type(path));
+                if (gzipped)
+                    res.set(http::field::content_encoding, "gzip");
+                res.content_length(file->size);
+                return send(std::move(res));
+            }
+            http::response<static_file_body> res{http::status::ok, req.version()};
+            set_headers(res);
             res.set(http::field::content_type, mime_type(path));
-            res.content_length(size);
-            res.keep_alive(req.keep_alive());
+            if (gzipped)
+                res.set(http::field::content_encoding, "gzip");
+            res.body() = std::move(file);
+            res.content_length(res.body()->size);
             return send(std::move(res));
         }
     } catch (const std::exception& e) {
@@ -277,8 +1525,144 @@ void handle_request(
     }
 }
 
+// Connection over TCP or a Unix domain socket
+template <class Protocol>
+using basic_stream = beast::basic_stream<Protocol, beast::tcp_stream::executor_type, beast::unlimited_rate_policy>;
+
+template <class Executor>
+static std::string client_address(const net::basic_stream_socket<tcp, Executor>& socket) {
+    beast::error_code ec;
+    auto              endpoint = socket.remote_endpoint(ec);
+    if (ec)
+        return {};
+    auto address = endpoint.address();
+    if (!address.is_v6())
+        return address.to_string();
+    auto v6 = address.to_v6();
+    if (v6.is_v4_mapped())
+        return net::ip::make_address_v4(net::ip::v4_mapped, v6).to_string();
+
+    // A host usually has a whole /64 to pick addresses from, so it counts as one client
+    auto bytes = v6.to_bytes();
+    std::fill(bytes.begin() + 8, bytes.end(), 0);
+    return net::ip::address_v6(bytes).to_string() + "/64";
+}
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+// Local clients all share one address, and aren't limited
+template <class Executor>
+static std::string client_address(const net::basic_stream_socket<net::local::stream_protocol, Executor>&) {
+    return {};
+}
+#endif
+
+// Handles a /wasmql/v1/subscribe connection. Each binary message from the client subscribes to one query:
+// the payload of a sub-request as a client WASM creates it, or nothing to follow the database status.
+// Subscriptions are numbered from 0 in the order they arrive. The server sends a binary message each time
+// a subscription's result changes: varuint32 subscription number, uint32 head block, then the result.
+template <class Protocol>
+class websocket_session : public subscription_target, public std::enable_shared_from_this<websocket_session<Protocol>> {
+    struct outgoing {
+        uint32_t                                 id     = {};
+        std::vector<char>                        header = {};
+        std::shared_ptr<const std::vector<char>> result = {};
+    };
+
+    websocket::stream<basic_stream<Protocol>> ws_;
+    beast::flat_buffer                        buffer_;
+    std::shared_ptr<const server_context>     context_;
+    std::deque<outgoing>                      outbox_; // front() is being written
+    uint32_t                                  next_id_ = 0;
+
+  public:
+    websocket_session(typename Protocol::socket&& socket, const std::shared_ptr<const server_context>& context)
+        : ws_(std::move(socket))
+        , context_(context) {
+        if (context_->metrics)
+            context_->metrics->websocket_sessions.add(1);
+    }
+
+    ~websocket_session() {
+        if (context_->metrics)
+            context_->metrics->websocket_sessions.add(-1);
+    }
+
+    // Accepts the upgrade request
+    template <class Body, class Allocator>
+    void run(http::request<Body, http::basic_fields<Allocator>> req) {
+        ws_.set_option(websocket::stream_base::timeout::suggested(beast::role_type::server));
+        ws_.read_message_max(10000);
+        ws_.binary(true);
+        ws_.async_accept(req, beast::bind_front_handler(&websocket_session::on_accept, this->shared_from_this()));
+    }
+
+    void push(uint32_t id, uint32_t head, const std::shared_ptr<const std::vector<char>>& result) override {
+        outgoing msg{id, {}, result};
+        abieos::push_varuint32(msg.header, id);
+        abieos::native_to_bin(head, msg.header);
+        net::post(ws_.get_executor(), [self = this->shared_from_this(), msg = std::move(msg)]() mutable {
+            // A newer result replaces one for the same subscription which hasn't started sending
+            for (size_t i = 1; i < self->outbox_.size(); ++i) {
+                if (self->outbox_[i].id == msg.id) {
+                    self->outbox_[i] = std::move(msg);
+                    return;
+                }
+            }
+            self->outbox_.push_back(std::move(msg));
+            if (self->outbox_.size() == 1)
+                self->do_write();
+        });
+    }
+
+  private:
+    void on_accept(beast::error_code ec) {
+        if (ec)
+            return fail(ec, "accept");
+        do_read();
+    }
+
+    void do_read() { ws_.async_read(buffer_, beast::bind_front_handler(&websocket_session::on_read, this->shared_from_this())); }
+
+    void on_read(beast::error_code ec, std::size_t bytes_transferred) {
+        boost::ignore_unused(bytes_transferred);
+        if (ec == websocket::error::closed)
+            return;
+        if (ec)
+            return fail(ec, "read");
+        if (!ws_.got_binary() || next_id_ >= context_->max_subscriptions)
+            return ws_.async_close(
+                websocket::close_reason{websocket::close_code::policy_error, ws_.got_binary() ? "too many subscriptions" : "expected binary"},
+                [self = this->shared_from_this()](beast::error_code) {});
+        auto              data = buffer_.data();
+        std::vector<char> request(net::buffers_begin(data), net::buffers_end(data));
+        buffer_.consume(buffer_.size());
+        if (!context_->subscriptions->subscribe(request, this->shared_from_this(), next_id_++))
+            return ws_.async_close(
+                websocket::close_reason{websocket::close_code::try_again_later, "server has too many subscriptions"},
+                [self = this->shared_from_this()](beast::error_code) {});
+        do_read();
+    }
+
+    void do_write() {
+        auto& msg = outbox_.front();
+        ws_.async_write(
+            std::array<net::const_buffer, 2>{net::buffer(msg.header), net::buffer(*msg.result)},
+            beast::bind_front_handler(&websocket_session::on_write, this->shared_from_this()));
+    }
+
+    void on_write(beast::error_code ec, std::size_t bytes_transferred) {
+        boost::ignore_unused(bytes_transferred);
+        if (ec)
+            return fail(ec, "write");
+        outbox_.pop_front();
+        if (!outbox_.empty())
+            do_write();
+    }
+};
+
 // Handles an HTTP server connection
-class http_session : public std::enable_shared_from_this<http_session> {
+template <class Protocol>
+class http_session : public reply_target, public std::enable_shared_from_this<http_session<Protocol>> {
     // This queue is used for HTTP pipelining.
     class queue {
         enum {
@@ -305,6 +1689,9 @@ class http_session : public std::enable_shared_from_this<http_session> {
         // Returns `true` if we have reached the queue limit
         bool is_full() const { return items_.size() >= limit; }
 
+        // Returns `true` if no responses are waiting to be sent
+        bool is_empty() const { return items_.empty(); }
+
         // Called when a message finishes sending
         // Returns `true` if the caller should initiate a read
         bool on_write() {
@@ -341,14 +1728,55 @@ class http_session : public std::enable_shared_from_this<http_session> {
             if (items_.size() == 1)
                 (*items_.front())();
         }
+
+        // Called to reserve a place for the streamed reply
+        void stream() {
+            struct work_impl : work {
+                http_session& self_;
+
+                explicit work_impl(http_session& self)
+                    : self_(self) {}
+
+                void operator()() {
+                    self_.streamed_->turn = true;
+                    self_.write_streamed();
+                }
+            };
+
+            items_.push_back(boost::make_unique<work_impl>(self_));
+            if (items_.size() == 1)
+                (*items_.front())();
+        }
     };
 
-    beast::tcp_stream                   stream_;
-    beast::flat_buffer                  buffer_;
-    std::shared_ptr<const std::string>  doc_root_;
-    std::shared_ptr<const shared_state> shared_state_;
-    std::shared_ptr<thread_state_cache> state_cache_;
-    queue                               queue_;
+    // A reply whose chunks arrive from a query thread while earlier chunks are being written
+    struct streamed_reply {
+        std::shared_ptr<response_stream>                             source     = {};
+        http::response<http::empty_body>                             header     = {};
+        boost::optional<http::response_serializer<http::empty_body>> serializer = {};
+        std::deque<std::shared_ptr<const std::vector<char>>>         chunks     = {};
+        bool                                                         turn       = false; // responses queued before it are done
+        bool                                                         writing    = false;
+        bool                                                         ended      = false; // no more chunks will arrive
+        bool                                                         ok         = false; // the query succeeded
+        bool                                                         failed     = false; // connection failed; drop chunks
+    };
+
+    basic_stream<Protocol>                stream_;
+    beast::flat_buffer                    buffer_;
+    std::shared_ptr<const server_context> context_;
+    queue                                 queue_;
+    std::string                           client_; // for rate limits
+
+    // Set once a write fails. Streamed replies which start afterwards are dropped as they arrive.
+    bool failed_ = false;
+
+    // Set while a query runs on the pool. Reading stops until it finishes so
+    // responses keep the same order as pipelined requests.
+    bool query_pending_ = false;
+
+    // Set while a streamed reply is being written. query_pending_ stays set until it's done.
+    std::unique_ptr<streamed_reply> streamed_;
 
     // The parser is stored in an optional container so we can
     // construct it from scratch it at the beginning of each new message.
@@ -356,19 +1784,163 @@ class http_session : public std::enable_shared_from_this<http_session> {
 
   public:
     // Take ownership of the socket
-    http_session(
-        tcp::socket&& socket, const std::shared_ptr<const std::string>& doc_root, const std::shared_ptr<const shared_state>& shared_state,
-        const std::shared_ptr<thread_state_cache>& state_cache)
+    http_session(typename Protocol::socket&& socket, const std::shared_ptr<const server_context>& context)
         : stream_(std::move(socket))
-        , doc_root_(doc_root)
-        , shared_state_(shared_state)
-        , state_cache_(state_cache)
-        , queue_(*this) {}
+        , context_(context)
+        , queue_(*this)
+        , client_(client_address(stream_.socket())) {
+        if (context_->metrics)
+            context_->metrics->http_sessions.add(1);
+    }
+
+    ~http_session() {
+        if (context_->metrics)
+            context_->metrics->http_sessions.add(-1);
+    }
 
     // Start the session
     void run() { do_read(); }
 
+    // Called by handle_request() after it queued a query
+    void begin_query() { query_pending_ = true; }
+
+    // Client's address; empty if it has none worth limiting by
+    const std::string& client() const { return client_; }
+
+    // Called on a query thread when a query finishes
+    template <class Message>
+    void send_query_response(Message&& msg) {
+        net::post(stream_.get_executor(), [self = this->shared_from_this(), msg = std::move(msg)]() mutable {
+            self->query_pending_ = false;
+            self->queue_(std::move(msg));
+            if (!self->queue_.is_full())
+                self->do_read();
+        });
+    }
+
+    void deliver(const reply_format& format, const query_outcome& outcome) override {
+        if (outcome.status != http::status::ok)
+            send_query_response(error_response(format.version, format.keep_alive, outcome.status, outcome.error));
+        else
+            send_reply(*this, *context_, format, *outcome.reply, outcome.etag);
+    }
+
+    void begin_stream(const reply_format& format, const std::shared_ptr<response_stream>& stream) override {
+        net::post(stream_.get_executor(), [self = this->shared_from_this(), format, stream] {
+            self->streamed_         = std::make_unique<streamed_reply>();
+            self->streamed_->source = stream;
+            auto& res               = self->streamed_->header;
+            res.version(format.version);
+            res.result(http::status::ok);
+            res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+            res.set(http::field::content_type, "application/octet-stream");
+            if (!self->context_->state->allow_origin.empty())
+                res.set(http::field::access_control_allow_origin, self->context_->state->allow_origin);
+            res.keep_alive(format.keep_alive);
+            res.chunked(true);
+            if (self->failed_)
+                self->streamed_->failed = true;
+            else
+                self->queue_.stream();
+        });
+    }
+
+    void stream_chunk(const std::shared_ptr<const std::vector<char>>& chunk) override {
+        net::post(stream_.get_executor(), [self = this->shared_from_this(), chunk] {
+            auto& s = *self->streamed_;
+            if (s.failed)
+                return s.source->release(chunk->size());
+            s.chunks.push_back(chunk);
+            self->write_streamed();
+        });
+    }
+
+    void end_stream(bool ok) override {
+        net::post(stream_.get_executor(), [self = this->shared_from_this(), ok] {
+            auto& s = *self->streamed_;
+            s.ended = true;
+            s.ok    = ok;
+            if (s.failed)
+                self->streamed_.reset();
+            else
+                self->write_streamed();
+        });
+    }
+
   private:
+    // Writes whatever is next for the streamed reply: the header, a chunk, or the end
+    void write_streamed() {
+        auto& s = *streamed_;
+        if (!s.turn || s.writing || s.failed)
+            return;
+        stream_.expires_after(std::chrono::seconds(30));
+        if (!s.serializer) {
+            s.serializer.emplace(s.header);
+            s.writing = true;
+            return http::async_write_header(
+                stream_, *s.serializer, beast::bind_front_handler(&http_session::on_write_streamed, this->shared_from_this(), 0));
+        }
+        if (!s.chunks.empty()) {
+            s.writing = true;
+            return net::async_write(
+                stream_, http::make_chunk(net::buffer(*s.chunks.front())),
+                beast::bind_front_handler(&http_session::on_write_streamed, this->shared_from_this(), s.chunks.front()->size()));
+        }
+        if (s.ended && !s.ok) {
+            // The reply can't be completed. Closing without the last chunk tells the client it's truncated.
+            streamed_.reset();
+            return do_close();
+        }
+        if (s.ended) {
+            s.writing = true;
+            return net::async_write(
+                stream_, http::make_chunk_last(), beast::bind_front_handler(&http_session::on_write_streamed_last, this->shared_from_this()));
+        }
+    }
+
+    void on_write_streamed(size_t chunk_size, beast::error_code ec, std::size_t bytes_transferred) {
+        boost::ignore_unused(bytes_transferred);
+        auto& s   = *streamed_;
+        s.writing = false;
+        if (chunk_size) {
+            s.chunks.pop_front();
+            s.source->release(chunk_size);
+        }
+        if (ec) {
+            fail(ec, "write");
+            return fail_streamed();
+        }
+        write_streamed();
+    }
+
+    void on_write_streamed_last(beast::error_code ec, std::size_t bytes_transferred) {
+        boost::ignore_unused(bytes_transferred);
+        bool close = streamed_->header.need_eof();
+        streamed_.reset();
+        query_pending_ = false;
+        if (ec)
+            return fail(ec, "write");
+        if (close)
+            return do_close();
+        queue_.on_write();
+        do_read();
+    }
+
+    // The connection failed. Stop holding back the query, and break the reference cycle with
+    // the stream once it ends.
+    void fail_streamed() {
+        failed_ = true;
+        if (!streamed_)
+            return;
+        auto& s = *streamed_;
+        for (auto& chunk : s.chunks)
+            s.source->release(chunk->size());
+        s.chunks.clear();
+        s.failed = true;
+        if (s.ended)
+            streamed_.reset();
+    }
+
     void do_read() {
         // Construct a new parser for each message
         parser_.emplace();
@@ -381,7 +1953,7 @@ class http_session : public std::enable_shared_from_this<http_session> {
         stream_.expires_after(std::chrono::seconds(30));
 
         // Read a request using the parser-oriented interface
-        http::async_read(stream_, buffer_, *parser_, beast::bind_front_handler(&http_session::on_read, shared_from_this()));
+        http::async_read(stream_, buffer_, *parser_, beast::bind_front_handler(&http_session::on_read, this->shared_from_this()));
     }
 
     void on_read(beast::error_code ec, std::size_t bytes_transferred) {
@@ -394,19 +1966,29 @@ class http_session : public std::enable_shared_from_this<http_session> {
         if (ec)
             return fail(ec, "read");
 
+        // Hand WebSocket subscriptions to their own session
+        if (websocket::is_upgrade(parser_->get()) && parser_->get().target() == "/wasmql/v1/subscribe" && context_->subscriptions) {
+            if (!queue_.is_empty())
+                return queue_(error_response(
+                    parser_->get().version(), false, http::status::bad_request, "WebSocket upgrade can't follow pipelined requests\n"));
+            return std::make_shared<websocket_session<Protocol>>(stream_.release_socket(), context_)->run(parser_->release());
+        }
+
         // Send the response
-        handle_request(*doc_root_, shared_state_, state_cache_, parser_->release(), queue_);
+        handle_request(context_, parser_->release(), queue_, this->shared_from_this());
 
         // If we aren't at the queue limit, try to pipeline another request
-        if (!queue_.is_full())
+        if (!query_pending_ && !queue_.is_full())
             do_read();
     }
 
     void on_write(bool close, beast::error_code ec, std::size_t bytes_transferred) {
         boost::ignore_unused(bytes_transferred);
 
-        if (ec)
-            return fail(ec, "write");
+        if (ec) {
+            fail(ec, "write");
+            return fail_streamed();
+        }
 
         if (close) {
             // This means we should close the connection, usually because
@@ -415,38 +1997,34 @@ class http_session : public std::enable_shared_from_this<http_session> {
         }
 
         // Inform the queue that a write completed
-        if (queue_.on_write()) {
+        if (queue_.on_write() && !query_pending_) {
             // Read another request
             do_read();
         }
     }
 
     void do_close() {
-        // Send a TCP shutdown
+        // Shut down the sending side
         beast::error_code ec;
-        stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+        stream_.socket().shutdown(net::socket_base::shutdown_send, ec);
 
         // At this point the connection is closed gracefully
     }
 };
 
 // Accepts incoming connections and launches the sessions
-class listener : public std::enable_shared_from_this<listener> {
-    net::io_context&                    ioc_;
-    tcp::acceptor                       acceptor_;
-    std::shared_ptr<const std::string>  doc_root_;
-    std::shared_ptr<const shared_state> shared_state_;
-    std::shared_ptr<thread_state_cache> state_cache_;
+template <class Protocol>
+class listener : public std::enable_shared_from_this<listener<Protocol>> {
+    net::io_context&                      ioc_;
+    typename Protocol::acceptor           acceptor_;
+    std::shared_ptr<const server_context> context_;
+    bool                                  listening_ = false;
 
   public:
-    listener(
-        net::io_context& ioc, tcp::endpoint endpoint, const std::shared_ptr<const std::string>& doc_root,
-        const std::shared_ptr<const shared_state>& shared_state)
+    listener(net::io_context& ioc, typename Protocol::endpoint endpoint, bool reuse_port, const std::shared_ptr<const server_context>& context)
         : ioc_(ioc)
         , acceptor_(net::make_strand(ioc))
-        , doc_root_(doc_root)
-        , shared_state_(shared_state)
-        , state_cache_(std::make_shared<thread_state_cache>(shared_state_)) {
+        , context_(context) {
 
         beast::error_code ec;
 
@@ -464,6 +2042,19 @@ class listener : public std::enable_shared_from_this<listener> {
             return;
         }
 
+        // Let other listeners bind the same endpoint; the kernel spreads connections across them
+        if (reuse_port) {
+#ifdef SO_REUSEPORT
+            acceptor_.set_option(net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true), ec);
+            if (ec) {
+                fail(ec, "set_option");
+                return;
+            }
+#else
+            throw std::runtime_error("SO_REUSEPORT is not supported on this platform");
+#endif
+        }
+
         // Bind to the server address
         acceptor_.bind(endpoint, ec);
         if (ec) {
@@ -477,23 +2068,27 @@ class listener : public std::enable_shared_from_this<listener> {
             fail(ec, "listen");
             return;
         }
+        listening_ = true;
     }
 
+    // False if setting up the acceptor failed; the failure was logged
+    bool listening() const { return listening_; }
+
     // Start accepting incoming connections
     void run() { do_accept(); }
 
   private:
     void do_accept() {
         // The new connection gets its own strand
-        acceptor_.async_accept(net::make_strand(ioc_), beast::bind_front_handler(&listener::on_accept, shared_from_this()));
+        acceptor_.async_accept(net::make_strand(ioc_), beast::bind_front_handler(&listener::on_accept, this->shared_from_this()));
     }
 
-    void on_accept(beast::error_code ec, tcp::socket socket) {
+    void on_accept(beast::error_code ec, typename Protocol::socket socket) {
         if (ec) {
             fail(ec, "accept");
         } else {
             // Create the http session and run it
-            std::make_shared<http_session>(std::move(socket), doc_root_, shared_state_, state_cache_)->run();
+            std::make_shared<http_session<Protocol>>(std::move(socket), context_)->run();
         }
 
         // Accept another connection
@@ -501,29 +2096,47 @@ class listener : public std::enable_shared_from_this<listener> {
     }
 };
 
+static void pin_thread(std::thread& thread, int cpu) {
+#ifdef __linux__
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (int err = pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus))
+        elog("unable to pin HTTP thread to cpu ${c}: ${m}", ("c", cpu)("m", std::strerror(err)));
+#else
+    elog("pinning HTTP threads is not supported on this platform");
+#endif
+}
+
 struct server_impl : http_server, std::enable_shared_from_this<server_impl> {
-    int                                 num_threads;
-    net::io_service                     ioc;
-    std::shared_ptr<const shared_state> state    = {};
-    std::string                         address  = {};
-    std::string                         port     = {};
-    std::vector<std::thread>            threads  = {};
-    std::unique_ptr<tcp::acceptor>      acceptor = {};
-
-    server_impl(int num_threads, const std::shared_ptr<const shared_state>& state, const std::string& address, const std::string& port)
-        : num_threads{num_threads}
-        , ioc{num_threads}
+    http_config                                   config;
+    std::vector<std::unique_ptr<net::io_context>> iocs     = {}; // one shared by all threads, or one per thread with reuse_port
+    std::shared_ptr<const shared_state>           state    = {};
+    std::shared_ptr<query_pool>                   pool     = {};
+    std::vector<std::thread>                      threads  = {};
+    std::unique_ptr<tcp::acceptor>                acceptor = {};
+
+    server_impl(const http_config& config, const std::shared_ptr<const shared_state>& state)
+        : config{config}
         , state{state}
-        , address{address}
-        , port{port} {}
+        , pool{std::make_shared<query_pool>(config.num_query_threads, config.max_queue)} {
+        if (config.reuse_port) {
+            for (int i = 0; i < config.num_threads; ++i)
+                iocs.push_back(std::make_unique<net::io_context>(1));
+        } else {
+            iocs.push_back(std::make_unique<net::io_context>(config.num_threads));
+        }
+    }
 
     virtual ~server_impl() {}
 
     virtual void stop() override {
-        ioc.stop();
+        for (auto& ioc : iocs)
+            ioc->stop();
         for (auto& t : threads)
             t.join();
         threads.clear();
+        pool->stop();
     }
 
     void start() {
@@ -535,27 +2148,84 @@ struct server_impl : http_server, std::enable_shared_from_this<server_impl> {
             FC_ASSERT(false, "unable to open listen socket");
         };
 
-        ilog("listen on ${a}:${p}", ("a", address)("p", port));
+        ilog("listen on ${a}:${p}", ("a", config.address)("p", config.port));
         boost::asio::ip::address a;
         try {
-            a = net::ip::make_address(address);
+            a = net::ip::make_address(config.address);
         } catch (std::exception& e) {
-            throw std::runtime_error("make_address(): "s + address + ": " + e.what());
+            throw std::runtime_error("make_address(): "s + config.address + ": " + e.what());
+        }
+        auto context               = std::make_shared<server_context>();
+        context->doc_root          = state->static_dir;
+        context->state             = state;
+        context->pool              = pool;
+        context->state_cache       = std::make_shared<thread_state_cache>(state, pool);
+        context->coalescer         = std::make_shared<query_coalescer>();
+        context->compress_min_size = config.compress_min_size;
+        context->compress_level    = config.compress_level;
+        context->stream_chunk_size = config.stream_chunk_size;
+        if (!context->doc_root.empty())
+            context->static_files = std::make_shared<static_file_cache>(config.static_cache_size);
+        if (config.slow_query.count() > 0 || config.trace_log_interval.count() > 0) {
+            context->tracer = std::make_shared<query_tracer>(*iocs[0], config.slow_query, config.trace_log_interval);
+            context->tracer->start();
+        }
+        if (config.response_cache_size)
+            context->responses = std::make_shared<response_cache>(config.response_cache_size, config.response_cache_ttls);
+        if (config.enable_metrics)
+            context->metrics = std::make_shared<server_metrics>(state, pool, context->responses);
+        if (config.client_rate > 0 || !config.target_rates.empty()) {
+            context->rate_limits  = std::make_shared<rate_limiter>();
+            context->client_rate  = config.client_rate;
+            context->target_rates = config.target_rates;
+            context->rate_burst   = config.rate_burst;
+        }
+        if (config.max_subscriptions) {
+            context->subscriptions = std::make_shared<subscription_registry>(
+                *iocs[0], config.subscription_poll, config.subscription_limit, state, pool, context->state_cache);
+            context->max_subscriptions = config.max_subscriptions;
+            context->subscriptions->start();
+        }
+        tcp::endpoint endpoint{a, (unsigned short)std::atoi(config.port.c_str())};
+        for (auto& ioc : iocs)
+            std::make_shared<listener<tcp>>(*ioc, endpoint, config.reuse_port, context)->run();
+
+        if (!config.unix_path.empty()) {
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+            ilog("listen on ${p}", ("p", config.unix_path));
+            // A socket file left by an earlier run would make bind() fail. Anything else at the path is left alone.
+            struct stat st;
+            if (!::lstat(config.unix_path.c_str(), &st)) {
+                if (!S_ISSOCK(st.st_mode))
+                    throw std::runtime_error(config.unix_path + " exists and isn't a socket");
+                if (::unlink(config.unix_path.c_str()))
+                    throw std::runtime_error("unable to remove " + config.unix_path + ": " + strerror(errno));
+            }
+            auto unix_listener = std::make_shared<listener<net::local::stream_protocol>>(
+                *iocs[0], net::local::stream_protocol::endpoint{config.unix_path}, false, context);
+            if (!unix_listener->listening())
+                throw std::runtime_error("unable to listen on " + config.unix_path);
+            unix_listener->run();
+#else
+            throw std::runtime_error("Unix domain sockets are not supported on this platform");
+#endif
         }
-        std::make_shared<listener>(
-            ioc, tcp::endpoint{a, (unsigned short)std::atoi(port.c_str())}, std::make_shared<std::string>(state->static_dir), state)
-            ->run();
 
-        threads.reserve(num_threads);
-        for (int i = 0; i < num_threads; ++i)
-            threads.emplace_back([self = shared_from_this()] { self->ioc.run(); });
+        threads.reserve(config.num_threads);
+        for (int i = 0; i < config.num_threads; ++i) {
+            auto& ioc = *iocs[i % iocs.size()];
+            threads.emplace_back([self = shared_from_this(), &ioc] { ioc.run(); });
+            if (!config.http_cpus.empty())
+                pin_thread(threads.back(), config.http_cpus[i % config.http_cpus.size()]);
+        }
     }
 }; // server_impl
 
-std::shared_ptr<http_server> http_server::create(
-    int num_threads, const std::shared_ptr<const shared_state>& state, const std::string& address, const std::string& port) {
-    FC_ASSERT(num_threads > 0, "too few threads");
-    auto server = std::make_shared<server_impl>(num_threads, state, address, port);
+std::shared_ptr<http_server> http_server::create(const http_config& config, const std::shared_ptr<const shared_state>& state) {
+    FC_ASSERT(config.num_threads > 0, "too few threads");
+    FC_ASSERT(config.num_query_threads > 0, "too few query threads");
+    FC_ASSERT(config.max_queue > 0, "query queue too small");
+    auto server = std::make_shared<server_impl>(config, state);
     server->start();
     return server;
 }
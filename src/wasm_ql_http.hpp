@@ -3,13 +3,40 @@
 #pragma once
 #include "wasm_ql.hpp"
 
+#include <map>
+
 namespace wasm_ql {
 
+struct http_config {
+    int                                              num_threads         = {}; // threads handling HTTP I/O
+    int                                              num_query_threads   = {}; // threads running queries
+    uint32_t                                         max_queue           = {}; // maximum number of requests waiting for a query thread
+    size_t                                           response_cache_size = {}; // bytes; 0 disables the response cache
+    std::map<std::string, std::chrono::milliseconds> response_cache_ttls = {}; // by target; how long to keep responses which may change
+    size_t                                           compress_min_size   = {}; // smallest reply to compress; 0 disables compression
+    int                                              compress_level      = {}; // zlib level, 1-9
+    size_t                                           stream_chunk_size   = {}; // bytes; 0 disables streamed replies
+    uint32_t                                         max_subscriptions   = {}; // per WebSocket connection; 0 disables subscriptions
+    uint32_t                                         subscription_limit  = {}; // across all WebSocket connections
+    size_t                                           static_cache_size   = {}; // bytes of static files to keep loaded
+    std::chrono::milliseconds                        slow_query          = {}; // log queries taking at least this long; 0 disables
+    std::chrono::seconds                             trace_log_interval  = {}; // how often to log query timing histograms; 0 disables
+    bool                                             enable_metrics      = {}; // serve /metrics
+    double                                           client_rate         = {}; // query requests per second per client address; 0: no limit
+    std::map<std::string, double>                    target_rates        = {}; // query requests per second per target, from all clients
+    double                                           rate_burst          = {}; // seconds of requests a rate limit lets a client save up
+    std::chrono::milliseconds                        subscription_poll   = {}; // how often to check subscriptions for a new head
+    bool                                             reuse_port          = {}; // one io_context and SO_REUSEPORT acceptor per HTTP thread
+    std::vector<int>                                 http_cpus           = {}; // pin HTTP thread i to http_cpus[i % size]; empty: don't pin
+    std::string                                      address             = {};
+    std::string                                      port                = {};
+    std::string                                      unix_path           = {}; // also listen on this Unix domain socket; empty: don't
+};
+
 struct http_server {
     virtual ~http_server() {}
 
-    static std::shared_ptr<http_server> create( //
-        int num_threads, const std::shared_ptr<const shared_state>& state, const std::string& address, const std::string& port);
+    static std::shared_ptr<http_server> create(const http_config& config, const std::shared_ptr<const shared_state>& state);
 
     virtual void stop() = 0;
 };
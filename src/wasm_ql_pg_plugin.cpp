@@ -24,7 +24,61 @@ struct pg_query_session : query_session {
     virtual ~pg_query_session() {}
 
     std::shared_ptr<pg_database_interface> db_iface;
-    pqxx::connection                       sql_connection = {};
+    pqxx::connection                       sql_connection   = {};
+    std::unique_ptr<pqxx::work>            cursor_work      = {};
+    uint32_t                               num_open_cursors = 0;
+    uint32_t                               next_cursor_id   = 0;
+
+    // Has the server cancel statements in t which run past the deadline
+    void limit_statement_time(pqxx::work& t) {
+        if (deadline == std::chrono::steady_clock::time_point::max())
+            return;
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+        if (left <= 0)
+            throw query_error(504, "query timed out");
+        t.exec("set local statement_timeout = " + std::to_string(left));
+    }
+
+    // Runs f, reporting a statement cancelled by limit_statement_time() as a timeout
+    template <typename F>
+    static auto timed(F f) {
+        try {
+            return f();
+        } catch (const pqxx::query_cancelled&) {
+            throw query_error(504, "query timed out");
+        }
+    }
+
+    // Open cursors hold a transaction across host calls. A connection only allows one transaction
+    // at a time, so queries share that transaction while it's open.
+    template <typename F>
+    auto in_transaction(F f) {
+        return timed([&] {
+            if (cursor_work)
+                return f(*cursor_work);
+            pqxx::work t(sql_connection);
+            limit_statement_time(t);
+            auto result = f(t);
+            t.commit();
+            return result;
+        });
+    }
+
+    pqxx::work& begin_cursor_work() {
+        if (!cursor_work) {
+            auto t = std::make_unique<pqxx::work>(sql_connection);
+            limit_statement_time(*t);
+            cursor_work = std::move(t);
+        }
+        ++num_open_cursors;
+        return *cursor_work;
+    }
+
+    // Nothing is written through the cursor transaction, so dropping it without a commit is fine
+    void end_cursor_work() {
+        if (!--num_open_cursors)
+            cursor_work.reset();
+    }
 
     virtual state_history::fill_status get_fill_status() override {
         pqxx::work t(sql_connection);
@@ -48,7 +102,15 @@ struct pg_query_session : query_session {
         return pg::sql_to_checksum256(result[0][0].c_str());
     }
 
-    virtual std::vector<char> query_database(abieos::input_buffer query_bin, uint32_t head) override {
+    // A query_* request translated to SQL
+    struct sql_query {
+        const pg::query*           query     = nullptr;
+        std::string                sql       = {};
+        std::optional<std::string> cache_key = {}; // set if the result may be cached
+    };
+
+    sql_query query_to_sql(abieos::input_buffer query_bin, const state_history::fill_status& fill_status) {
+        auto         whole_query = query_bin;
         abieos::name query_name;
         abieos::bin_to_native(query_name, query_bin);
 
@@ -60,7 +122,11 @@ struct pg_query_session : query_session {
 
         uint32_t snapshot_block_num = 0;
         if (query.has_block_snapshot)
-            snapshot_block_num = std::min(head, abieos::bin_to_native<uint32_t>(query_bin));
+            snapshot_block_num = std::min(fill_status.head, abieos::bin_to_native<uint32_t>(query_bin));
+        if (query_result_cache::is_snapshot_query(query))
+            used_block(snapshot_block_num);
+        else
+            used_head_block(fill_status.head);
         std::string query_str = "select * from \"" + db_iface->schema + "\"." + query.function + "(";
         bool        need_sep  = false;
         if (query.has_block_snapshot) {
@@ -82,10 +148,17 @@ struct pg_query_session : query_session {
         query_str += pg::sep(false) + pg::sql_str(false, std::min(max_results, query.max_results));
         query_str += ")";
 
-        pqxx::work        t(sql_connection);
-        auto              exec_result = t.exec(query_str);
+        sql_query result{&query, std::move(query_str)};
+        if (db_iface->result_cache)
+            result.cache_key = query_result_cache::key(query, whole_query, snapshot_block_num, fill_status);
+        return result;
+    }
+
+    // Serializes rows returned by query_to_sql()'s SQL
+    std::vector<char> result_to_bin(const pg::query& query, const pqxx::result& exec_result) {
         std::vector<char> result;
         std::vector<char> row_bin;
+        rows_scanned += exec_result.size();
         abieos::push_varuint32(result, exec_result.size());
         for (const auto& r : exec_result) {
             row_bin.clear();
@@ -107,13 +180,103 @@ struct pg_query_session : query_session {
             abieos::push_varuint32(result, row_bin.size());
             result.insert(result.end(), row_bin.begin(), row_bin.end());
         }
-        t.commit();
         if ((uint32_t)result.size() != result.size())
             throw std::runtime_error("query_database: result is too big");
         return result;
     }
+
+    virtual std::vector<char> query_database(abieos::input_buffer query_bin, const state_history::fill_status& fill_status) override {
+        auto query = query_to_sql(query_bin, fill_status);
+        if (query.cache_key)
+            if (auto cached = db_iface->result_cache->get(fill_status, *query.cache_key))
+                return std::move(*cached);
+        auto result = in_transaction([&](pqxx::work& t) { return result_to_bin(*query.query, t.exec(query.sql)); });
+        if (query.cache_key)
+            db_iface->result_cache->put(fill_status, *query.cache_key, result);
+        return result;
+    }
+
+    // Sends every query before waiting on the first result, so the batch costs one round trip instead of one per query
+    virtual std::vector<std::vector<char>>
+    query_database_batch(const std::vector<abieos::input_buffer>& queries, const state_history::fill_status& fill_status) override {
+        std::vector<sql_query>         sql_queries;
+        std::vector<std::vector<char>> result(queries.size());
+        std::vector<bool>              cached(queries.size());
+        sql_queries.reserve(queries.size());
+        for (size_t i = 0; i < queries.size(); ++i) {
+            sql_queries.push_back(query_to_sql(queries[i], fill_status));
+            auto& cache_key = sql_queries.back().cache_key;
+            if (cache_key) {
+                if (auto r = db_iface->result_cache->get(fill_status, *cache_key)) {
+                    result[i] = std::move(*r);
+                    cached[i] = true;
+                }
+            }
+        }
+
+        in_transaction([&](pqxx::work& t) {
+            pqxx::pipeline                        pipeline(t);
+            std::vector<pqxx::pipeline::query_id> ids(queries.size());
+            for (size_t i = 0; i < queries.size(); ++i)
+                if (!cached[i])
+                    ids[i] = pipeline.insert(sql_queries[i].sql);
+            for (size_t i = 0; i < queries.size(); ++i) {
+                if (cached[i])
+                    continue;
+                result[i] = result_to_bin(*sql_queries[i].query, pipeline.retrieve(ids[i]));
+                if (sql_queries[i].cache_key)
+                    db_iface->result_cache->put(fill_status, *sql_queries[i].cache_key, result[i]);
+            }
+            pipeline.complete();
+            return true;
+        });
+        return result;
+    }
+
+    virtual std::unique_ptr<query_cursor>
+    open_cursor(abieos::input_buffer query_bin, const state_history::fill_status& fill_status) override;
 }; // pg_query_session
 
+// Reads rows through a server-side cursor, so only one batch at a time crosses the connection
+struct pg_query_cursor : query_cursor {
+    using cursor_type = pqxx::stateless_cursor<pqxx::cursor_base::read_only, pqxx::cursor_base::owned>;
+
+    pg_query_session&            session;
+    const pg::query&             query;
+    std::unique_ptr<cursor_type> cursor = {};
+    size_t                       pos    = 0;
+
+    pg_query_cursor(pg_query_session& session, const pg::query& query, const std::string& query_str)
+        : session(session)
+        , query(query) {
+        auto& t = session.begin_cursor_work();
+        try {
+            cursor = pg_query_session::timed([&] {
+                return std::make_unique<cursor_type>(t, query_str, "wasmql_cursor_" + std::to_string(session.next_cursor_id++), false);
+            });
+        } catch (...) {
+            session.end_cursor_work();
+            throw;
+        }
+    }
+
+    virtual ~pg_query_cursor() {
+        cursor.reset();
+        session.end_cursor_work();
+    }
+
+    virtual std::vector<char> next_batch(uint32_t max_rows) override {
+        auto rows = pg_query_session::timed([&] { return cursor->retrieve(pos, pos + max_rows); });
+        pos += rows.size();
+        return session.result_to_bin(query, rows);
+    }
+}; // pg_query_cursor
+
+std::unique_ptr<query_cursor> pg_query_session::open_cursor(abieos::input_buffer query_bin, const state_history::fill_status& fill_status) {
+    auto query = query_to_sql(query_bin, fill_status);
+    return std::make_unique<pg_query_cursor>(*this, *query.query, query.sql);
+}
+
 std::unique_ptr<query_session> pg_database_interface::create_query_session() {
     auto session      = std::make_unique<pg_query_session>();
     session->db_iface = shared_from_this();
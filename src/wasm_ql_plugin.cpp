@@ -1,7 +1,5 @@
 // copyright defined in LICENSE.txt
 
-// todo: timeout wasm
-// todo: timeout sql
 // todo: what should memory size limit be?
 // todo: check callbacks for recursion to limit stack size
 // todo: reformulate get_input_data and set_output_data for reentrancy
@@ -30,18 +28,22 @@ static abstract_plugin& _wasm_ql_plugin = app().register_plugin<wasm_ql_plugin>(
 
 struct wasm_ql_plugin_impl : std::enable_shared_from_this<wasm_ql_plugin_impl> {
     bool                                   stopping         = false;
-    int                                    num_threads      = {};
-    std::string                            endpoint_address = {};
-    std::string                            endpoint_port    = {};
+    wasm_ql::http_config                   http_config      = {};
+    uint32_t                               fill_status_poll = {};
+    uint32_t                               query_cache_mb   = {};
     std::shared_ptr<wasm_ql::shared_state> state            = {};
     std::shared_ptr<wasm_ql::http_server>  http_server      = {};
 
-    void start_http() { http_server = wasm_ql::http_server::create(num_threads, state, endpoint_address, endpoint_port); }
+    void start_http() { http_server = wasm_ql::http_server::create(http_config, state); }
 
     void shutdown() {
         stopping = true;
         if (http_server)
             http_server->stop();
+        if (state && state->modules)
+            state->modules->stop_watching();
+        if (state && state->fill_status)
+            state->fill_status->stop();
     }
 }; // wasm_ql_plugin_impl
 
@@ -55,11 +57,58 @@ wasm_ql_plugin::~wasm_ql_plugin() {
 
 void wasm_ql_plugin::set_program_options(options_description& cli, options_description& cfg) {
     auto op = cfg.add_options();
-    op("wql-threads", bpo::value<int>()->default_value(8), "Number of threads to process requests");
+    op("wql-threads", bpo::value<int>()->default_value(8), "Number of threads to run queries");
+    op("wql-http-threads", bpo::value<int>()->default_value(2), "Number of threads to handle HTTP connections");
+    op("wql-max-queue", bpo::value<uint32_t>()->default_value(1000),
+       "Maximum number of requests waiting for a query thread. Requests beyond this get 503.");
     op("wql-listen", bpo::value<std::string>()->default_value("127.0.0.1:8880"), "Endpoint to listen on");
+    op("wql-unix-listen", bpo::value<std::string>(), "Unix domain socket path to also listen on (default: disabled)");
+    op("wql-reuse-port", "Give each HTTP thread its own event loop and SO_REUSEPORT listen socket");
+    op("wql-http-cpu", bpo::value<std::vector<int>>()->composing(),
+       "CPU to pin an HTTP thread to. May be repeated; HTTP threads use these in turn (default: not pinned)");
     op("wql-allow-origin", bpo::value<std::string>(), "Access-Control-Allow-Origin header. Use \"*\" to allow any.");
     op("wql-wasm-dir", bpo::value<std::string>()->default_value("."), "Directory to fetch WASMs from");
     op("wql-static-dir", bpo::value<std::string>(), "Directory to serve static files from (default: disabled)");
+    op("wql-static-cache-mb", bpo::value<uint32_t>()->default_value(32), "Memory for keeping static files loaded");
+    op("wql-fill-status-poll-ms", bpo::value<uint32_t>()->default_value(100),
+       "How often to check the database's fill status for new blocks and forks. Must be at least 1.");
+    op("wql-query-cache-mb", bpo::value<uint32_t>()->default_value(64),
+       "Memory for caching results of queries at irreversible blocks. 0 disables the cache.");
+    op("wql-response-cache-mb", bpo::value<uint32_t>()->default_value(0),
+       "Memory for caching whole HTTP responses. Responses which only depend on irreversible blocks stay until evicted. "
+       "0 disables the cache.");
+    op("wql-response-cache-ttl", bpo::value<std::vector<std::string>>()->composing(),
+       "target=seconds: also cache responses to target (e.g. /v1/chain/get_block) which may still change, for up to this long. "
+       "May be repeated.");
+    op("wql-compress-min-size", bpo::value<uint32_t>()->default_value(1024),
+       "Compress query responses of at least this many bytes when the client accepts gzip or deflate. 0 disables compression.");
+    op("wql-compress-level", bpo::value<int>()->default_value(6), "Compression level for query responses, 1 (fastest) to 9 (smallest)");
+    op("wql-stream-chunk-kb", bpo::value<uint32_t>()->default_value(256),
+       "Send /v1/ replies built with append_output_data in chunks of this size while the query runs. 0 disables streaming.");
+    op("wql-max-subscriptions", bpo::value<uint32_t>()->default_value(0),
+       "Maximum number of queries one WebSocket connection can subscribe to at /wasmql/v1/subscribe. 0 disables subscriptions.");
+    op("wql-max-total-subscriptions", bpo::value<uint32_t>()->default_value(10000),
+       "Maximum number of subscriptions across all WebSocket connections. Connections subscribing beyond this are closed.");
+    op("wql-slow-query-ms", bpo::value<uint32_t>()->default_value(1000),
+       "Log a query's phase timings, rows scanned and reply size when it takes at least this long. 0 disables");
+    op("wql-trace-log-sec", bpo::value<uint32_t>()->default_value(0), "How often to log query timing histograms. 0 disables");
+    op("wql-metrics", "Serve metrics at /metrics in Prometheus text format");
+    op("wql-client-rate", bpo::value<double>()->default_value(0),
+       "Queries per second each client address may make. Requests beyond this get 429. 0 is unlimited.");
+    op("wql-target-rate", bpo::value<std::vector<std::string>>()->composing(),
+       "target=rate: limit target (e.g. /v1/history/get_actions) to this many queries per second from all clients. Requests "
+       "beyond this get 429. May be repeated.");
+    op("wql-rate-burst", bpo::value<double>()->default_value(2),
+       "Seconds' worth of queries a client or target may save up and then send at once under --wql-client-rate and --wql-target-rate");
+    op("wql-wasm-concurrency", bpo::value<uint32_t>()->default_value(0),
+       "Maximum number of queries which may run each WASM at once; /v1/ targets count separately. Requests beyond this get 503. "
+       "0 is unlimited.");
+    op("wql-max-rows", bpo::value<uint64_t>()->default_value(0),
+       "Maximum number of rows one request may scan, counting all of its sub-requests. Requests which scan more get 503. 0 is unlimited.");
+    op("wql-timeout-ms", bpo::value<uint32_t>()->default_value(0),
+       "Maximum time a query may take, including its wait for a query thread. WASM execution and database reads stop once "
+       "it passes, and the request gets 504. 0 is unlimited.");
+    op("wql-vm", bpo::value<std::string>()->default_value("interpreter"), "How to run query WASMs: interpreter or jit");
     op("wql-console", "Show console output");
 }
 
@@ -69,16 +118,88 @@ void wasm_ql_plugin::plugin_initialize(const variables_map& options) {
         if (ip_port.find(':') == std::string::npos)
             throw std::runtime_error("invalid --wql-listen value: " + ip_port);
 
-        my->state            = std::make_shared<wasm_ql::shared_state>();
-        my->state->console   = options.count("wql-console");
-        my->num_threads      = options.at("wql-threads").as<int>();
-        my->endpoint_port    = ip_port.substr(ip_port.find(':') + 1, ip_port.size());
-        my->endpoint_address = ip_port.substr(0, ip_port.find(':'));
-        my->state->wasm_dir  = options.at("wql-wasm-dir").as<std::string>();
+        my->state                           = std::make_shared<wasm_ql::shared_state>();
+        my->state->console                  = options.count("wql-console");
+        my->http_config.num_query_threads   = options.at("wql-threads").as<int>();
+        my->http_config.num_threads         = options.at("wql-http-threads").as<int>();
+        my->http_config.max_queue           = options.at("wql-max-queue").as<uint32_t>();
+        my->http_config.port                = ip_port.substr(ip_port.find(':') + 1, ip_port.size());
+        my->http_config.address             = ip_port.substr(0, ip_port.find(':'));
+        my->state->wasm_dir                 = options.at("wql-wasm-dir").as<std::string>();
+        my->fill_status_poll                = options.at("wql-fill-status-poll-ms").as<uint32_t>();
+        my->query_cache_mb                  = options.at("wql-query-cache-mb").as<uint32_t>();
+        my->http_config.response_cache_size = size_t(options.at("wql-response-cache-mb").as<uint32_t>()) * 1024 * 1024;
+        my->http_config.compress_min_size   = options.at("wql-compress-min-size").as<uint32_t>();
+        my->http_config.compress_level      = options.at("wql-compress-level").as<int>();
+        my->http_config.stream_chunk_size   = size_t(options.at("wql-stream-chunk-kb").as<uint32_t>()) * 1024;
+        my->http_config.max_subscriptions   = options.at("wql-max-subscriptions").as<uint32_t>();
+        my->http_config.subscription_limit  = options.at("wql-max-total-subscriptions").as<uint32_t>();
+        my->http_config.static_cache_size   = size_t(options.at("wql-static-cache-mb").as<uint32_t>()) * 1024 * 1024;
+        my->http_config.slow_query          = std::chrono::milliseconds{options.at("wql-slow-query-ms").as<uint32_t>()};
+        my->http_config.trace_log_interval  = std::chrono::seconds{options.at("wql-trace-log-sec").as<uint32_t>()};
+        my->http_config.enable_metrics      = options.count("wql-metrics");
+        my->http_config.client_rate         = options.at("wql-client-rate").as<double>();
+        my->http_config.rate_burst          = options.at("wql-rate-burst").as<double>();
+        my->state->max_rows                 = options.at("wql-max-rows").as<uint64_t>();
+        my->state->timeout                  = std::chrono::milliseconds{options.at("wql-timeout-ms").as<uint32_t>()};
+        if (auto limit = options.at("wql-wasm-concurrency").as<uint32_t>())
+            my->state->wasm_limiter = std::make_shared<wasm_ql::concurrency_limiter>(limit);
+        my->http_config.subscription_poll   = std::chrono::milliseconds{my->fill_status_poll};
+        my->http_config.reuse_port          = options.count("wql-reuse-port");
+        if (options.count("wql-http-cpu"))
+            my->http_config.http_cpus = options.at("wql-http-cpu").as<std::vector<int>>();
+        for (auto cpu : my->http_config.http_cpus)
+            if (cpu < 0)
+                throw std::runtime_error("invalid --wql-http-cpu value: " + std::to_string(cpu));
+        if (!my->fill_status_poll)
+            throw std::runtime_error("invalid --wql-fill-status-poll-ms value: 0");
+        if (my->http_config.compress_level < 1 || my->http_config.compress_level > 9)
+            throw std::runtime_error("invalid --wql-compress-level value: " + std::to_string(my->http_config.compress_level));
+        if (options.count("wql-response-cache-ttl")) {
+            for (auto& ttl : options.at("wql-response-cache-ttl").as<std::vector<std::string>>()) {
+                auto pos = ttl.find('=');
+                if (pos == std::string::npos || pos == 0 || pos + 1 == ttl.size() ||
+                    ttl.find_first_not_of("0123456789", pos + 1) != std::string::npos)
+                    throw std::runtime_error("invalid --wql-response-cache-ttl value: " + ttl);
+                my->http_config.response_cache_ttls[ttl.substr(0, pos)] = std::chrono::seconds{std::stoul(ttl.substr(pos + 1))};
+            }
+        }
+        if (my->http_config.client_rate < 0)
+            throw std::runtime_error("invalid --wql-client-rate value: " + std::to_string(my->http_config.client_rate));
+        if (my->http_config.rate_burst <= 0)
+            throw std::runtime_error("invalid --wql-rate-burst value: " + std::to_string(my->http_config.rate_burst));
+        if (options.count("wql-target-rate")) {
+            for (auto& rate : options.at("wql-target-rate").as<std::vector<std::string>>()) {
+                auto   pos = rate.find('=');
+                double value;
+                try {
+                    value = std::stod(rate.substr(pos + 1));
+                } catch (...) {
+                    value = 0;
+                }
+                if (pos == std::string::npos || pos == 0 || value <= 0)
+                    throw std::runtime_error("invalid --wql-target-rate value: " + rate);
+                my->http_config.target_rates[rate.substr(0, pos)] = value;
+            }
+        }
+        if (options.count("wql-unix-listen"))
+            my->http_config.unix_path = options.at("wql-unix-listen").as<std::string>();
         if (options.count("wql-allow-origin"))
             my->state->allow_origin = options.at("wql-allow-origin").as<std::string>();
         if (options.count("wql-static-dir"))
             my->state->static_dir = options.at("wql-static-dir").as<std::string>();
+        auto vm = options.at("wql-vm").as<std::string>();
+        if (vm == "interpreter")
+            my->state->vm = vm_type::interpreter;
+        else if (vm == "jit") {
+#ifdef __x86_64__
+            my->state->vm = vm_type::jit;
+#else
+            throw std::runtime_error("--wql-vm jit is only supported on x86_64");
+#endif
+        } else
+            throw std::runtime_error("invalid --wql-vm value: " + vm);
+        my->state->modules = std::make_shared<wasm_ql::module_cache>(my->state->wasm_dir);
 
         register_callbacks();
     }
@@ -88,6 +209,12 @@ void wasm_ql_plugin::plugin_initialize(const variables_map& options) {
 void wasm_ql_plugin::plugin_startup() {
     if (!my->state->db_iface)
         throw std::runtime_error("wasm_ql_plugin needs either wasm_ql_pg_plugin or wasm_ql_rocksdb_plugin");
+    if (my->query_cache_mb)
+        my->state->db_iface->result_cache = std::make_shared<query_result_cache>(size_t(my->query_cache_mb) * 1024 * 1024);
+    my->state->fill_status =
+        std::make_shared<wasm_ql::fill_status_tracker>(my->state->db_iface, std::chrono::milliseconds{my->fill_status_poll});
+    my->state->fill_status->start();
+    my->state->modules->start_watching();
     my->start_http();
 }
 void wasm_ql_plugin::plugin_shutdown() { my->shutdown(); }
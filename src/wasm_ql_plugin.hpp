@@ -4,20 +4,95 @@
 #include <appbase/application.hpp>
 
 #include "query_config.hpp"
+#include "query_result_cache.hpp"
 #include "state_history.hpp"
 
+#include <chrono>
+#include <stdexcept>
+
+namespace metrics {
+class registry;
+}
+
+// Thrown when a query should fail with a particular HTTP status instead of 500
+struct query_error : std::runtime_error {
+    unsigned status;
+
+    query_error(unsigned status, const std::string& msg)
+        : std::runtime_error(msg)
+        , status(status) {}
+};
+
+// Incrementally reads the results of one query
+struct query_cursor {
+    virtual ~query_cursor() {}
+
+    // Returns up to max_rows more rows, serialized the same way as query_database's result. Returns no rows once
+    // the query is exhausted.
+    virtual std::vector<char> next_batch(uint32_t max_rows) = 0;
+};
+
 struct query_session {
+    // Highest block the results returned so far depend on. Empty until the first query.
+    std::optional<uint32_t> newest_block_used = {};
+
+    // Set once a result depends on head, rather than on a fixed snapshot; such results change as head moves
+    bool used_head = false;
+
+    // Rows read so far, for tracing. Backends count however is natural for them.
+    uint64_t rows_scanned = 0;
+
+    // When the running request must finish. Backends call check_deadline() in loops which may run long.
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+
     virtual ~query_session() {}
 
-    virtual state_history::fill_status         get_fill_status()                                         = 0;
-    virtual std::optional<abieos::checksum256> get_block_id(uint32_t block_num)                          = 0;
-    virtual std::vector<char>                  query_database(abieos::input_buffer query, uint32_t head) = 0;
+    void used_block(uint32_t block_num) { newest_block_used = std::max(newest_block_used.value_or(0), block_num); }
+
+    void used_head_block(uint32_t head) {
+        used_head = true;
+        used_block(head);
+    }
+
+    void check_deadline() const {
+        if (std::chrono::steady_clock::now() >= deadline)
+            throw query_error(504, "query timed out");
+    }
+
+    virtual state_history::fill_status         get_fill_status()                = 0;
+    virtual std::optional<abieos::checksum256> get_block_id(uint32_t block_num) = 0;
+
+    virtual std::vector<char> query_database(abieos::input_buffer query, const state_history::fill_status& fill_status) = 0;
+
+    // Cursors may use this session's resources; they must be destroyed before it is
+    virtual std::unique_ptr<query_cursor> open_cursor(abieos::input_buffer query, const state_history::fill_status& fill_status) = 0;
+
+    // Runs several queries against the same fill_status. The default runs them one after another on this
+    // session's iterators; backends with per-query round trips override this to overlap them.
+    virtual std::vector<std::vector<char>>
+    query_database_batch(const std::vector<abieos::input_buffer>& queries, const state_history::fill_status& fill_status) {
+        std::vector<std::vector<char>> result;
+        result.reserve(queries.size());
+        for (auto& query : queries)
+            result.push_back(query_database(query, fill_status));
+        return result;
+    }
 };
 
 struct database_interface {
     virtual ~database_interface() {}
 
+    // Set by wasm_ql_plugin when --wql-query-cache-mb is nonzero
+    std::shared_ptr<query_result_cache> result_cache = {};
+
     virtual std::unique_ptr<query_session> create_query_session() = 0;
+
+    // Changes before an in-process filler discards blocks. Backends whose filler runs in another
+    // process return 0; wasm-ql then notices forks by polling fill_status.
+    virtual uint64_t get_fork_generation() { return 0; }
+
+    // Adds the backend's own metrics to wasm-ql's /metrics
+    virtual void register_metrics(metrics::registry& registry) {}
 };
 
 class wasm_ql_plugin : public appbase::plugin<wasm_ql_plugin> {
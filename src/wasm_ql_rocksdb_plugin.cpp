@@ -17,11 +17,16 @@ struct rocksdb_database_interface : database_interface, std::enable_shared_from_
     virtual ~rocksdb_database_interface() {}
 
     virtual std::unique_ptr<query_session> create_query_session();
+
+    virtual uint64_t get_fork_generation() override { return rocksdb_inst->fork_generation.load(); }
+
+    virtual void register_metrics(metrics::registry& registry) override {
+        app().find_plugin<rocksdb_plugin>()->register_metrics(registry);
+    }
 };
 
 struct rocksdb_query_session : query_session {
     std::shared_ptr<rocksdb_database_interface> db_iface;
-    state_history::fill_status                  fill_status;
     std::unique_ptr<rocksdb::Iterator>          it_for_get;
     std::unique_ptr<rocksdb::Iterator>          it0;
     std::unique_ptr<rocksdb::Iterator>          it1;
@@ -36,19 +41,20 @@ struct rocksdb_query_session : query_session {
         , it1{db_iface->rocksdb_inst->database.db->NewIterator(rocksdb::ReadOptions())}
         , it2{db_iface->rocksdb_inst->database.db->NewIterator(rocksdb::ReadOptions())}
         , it3{db_iface->rocksdb_inst->database.db->NewIterator(rocksdb::ReadOptions())}
-        , it4{db_iface->rocksdb_inst->database.db->NewIterator(rocksdb::ReadOptions())} {
-
-        auto f = rdb::get<state_history::fill_status>(*it_for_get, kv::make_fill_status_key(), false);
-        if (f)
-            fill_status = *f;
-    }
+        , it4{db_iface->rocksdb_inst->database.db->NewIterator(rocksdb::ReadOptions())} {}
 
     virtual ~rocksdb_query_session() {}
 
-    virtual state_history::fill_status get_fill_status() override { return fill_status; }
+    // These read the latest data rather than the session's iterators; fill_status_tracker keeps one session for polling
+    virtual state_history::fill_status get_fill_status() override {
+        auto f = rdb::get<state_history::fill_status>(db_iface->rocksdb_inst->database, kv::make_fill_status_key(), false);
+        if (f)
+            return *f;
+        return {};
+    }
 
     virtual std::optional<abieos::checksum256> get_block_id(uint32_t block_num) override {
-        auto rb = rdb::get<kv::received_block>(*it_for_get, kv::make_received_block_key(block_num), false);
+        auto rb = rdb::get<kv::received_block>(db_iface->rocksdb_inst->database, kv::make_received_block_key(block_num), false);
         if (rb)
             return rb->block_id;
         return {};
@@ -72,7 +78,26 @@ struct rocksdb_query_session : query_session {
         }
     }
 
-    virtual std::vector<char> query_database(abieos::input_buffer query_bin, uint32_t head) override {
+    // Returns the row an index entry refers to. Covering indexes hold a copy, which saves a seek; entries
+    // written before the index became covering are empty and fall back to the table.
+    abieos::input_buffer get_indexed_row(
+        rocksdb::Iterator& it, abieos::input_buffer index_key, abieos::input_buffer index_data, const kv::table& table,
+        const kv::index& index) {
+        if (index.covering && index_data.pos != index_data.end)
+            return index_data;
+        return *rdb::get_raw(it, extract_pk_from_index(index_key, table, index.sort_keys), true);
+    }
+
+    // A query_* request, parsed into the index range it scans
+    struct index_scan {
+        const kv::query*  query              = nullptr;
+        uint32_t          snapshot_block_num = 0;
+        std::vector<char> first              = {};
+        std::vector<char> last               = {};
+        uint32_t          remaining          = 0; // index keys left before reaching the query's max_results
+    };
+
+    index_scan parse_query(abieos::input_buffer query_bin, const state_history::fill_status& fill_status) {
         abieos::name query_name;
         abieos::bin_to_native(query_name, query_bin);
 
@@ -86,32 +111,53 @@ struct rocksdb_query_session : query_session {
         if (!query.arg_types.empty())
             throw std::runtime_error("query_database: query: " + (std::string)query_name + " not implemented");
 
-        uint32_t snapshot_block_num = 0;
+        index_scan scan;
+        scan.query = &query;
         if (query.has_block_snapshot)
-            snapshot_block_num = std::min(head, abieos::bin_to_native<uint32_t>(query_bin));
+            scan.snapshot_block_num = std::min(fill_status.head, abieos::bin_to_native<uint32_t>(query_bin));
+        if (query_result_cache::is_snapshot_query(query))
+            used_block(scan.snapshot_block_num);
+        else
+            used_head_block(fill_status.head);
 
-        auto first = kv::make_index_key(query.table_obj->short_name, query.index_obj->short_name);
-        auto last  = first;
+        scan.first = kv::make_index_key(query.table_obj->short_name, query.index_obj->short_name);
+        scan.last  = scan.first;
 
         auto add_fields = [&](auto& dest, auto& types) {
             for (auto& type : types)
                 type.query_to_key(dest, query_bin);
         };
-        add_fields(first, query.index_obj->range_types);
-        add_fields(last, query.index_obj->range_types);
+        add_fields(scan.first, query.index_obj->range_types);
+        add_fields(scan.last, query.index_obj->range_types);
 
-        auto max_results = std::min(abieos::read_raw<uint32_t>(query_bin), query.max_results);
+        // A limit of 0 still reads the first key, as query_database always has
+        scan.remaining = std::max(std::min(abieos::read_raw<uint32_t>(query_bin), query.max_results), uint32_t(1));
+        return scan;
+    }
 
-        std::vector<std::vector<char>> rows;
-        uint32_t                       num_results = 0;
-        rdb::for_each_subkey(*it0, first, last, [&](const auto& index_key, auto, auto) {
+    // Appends rows for up to max_keys more index keys. Advances scan.first past the keys read and
+    // sets scan.remaining to 0 once the range is exhausted.
+    void read_rows(index_scan& scan, uint32_t max_keys, std::vector<std::vector<char>>& rows) {
+        auto&    query       = *scan.query;
+        auto     limit       = std::min(max_keys, scan.remaining);
+        uint32_t num_results = 0;
+        bool     more        = false;
+        if (!limit)
+            return;
+        rdb::for_each_subkey(*it0, scan.first, scan.last, [&](const auto& index_key, auto, auto) {
+            if (num_results >= limit) {
+                scan.first = index_key;
+                more       = true;
+                return false;
+            }
+            check_deadline();
+            ++rows_scanned;
             std::vector index_key_limit_block = index_key;
             if (query.table_obj->is_delta)
-                kv::append_index_suffix(index_key_limit_block, snapshot_block_num);
+                kv::append_index_suffix(index_key_limit_block, scan.snapshot_block_num);
             // todo: unify rdb's and pg's handling of negative result because of snapshot_block_num
-            rdb::for_each(*it1, index_key_limit_block, index_key, [&](auto index_value, auto) {
-                auto delta_value =
-                    *rdb::get_raw(*it2, extract_pk_from_index(index_value, *query.table_obj, query.index_obj->sort_keys), true);
+            rdb::for_each(*it1, index_key_limit_block, index_key, [&](auto index_value, auto index_data) {
+                auto delta_value = get_indexed_row(*it2, index_value, index_data, *query.table_obj, *query.index_obj);
                 rows.emplace_back(delta_value.pos, delta_value.end);
                 if (query.join_table) {
                     auto join_key = kv::make_index_key(query.join_table->short_name, query.join_query_short_name);
@@ -123,13 +169,12 @@ struct rocksdb_query_session : query_session {
                         append_fields(join_key, delta_value, query.join_key_values, table_positions, true);
                         auto join_key_limit_block = join_key;
                         if (query.join_query->table_obj->is_delta)
-                            kv::append_index_suffix(join_key_limit_block, snapshot_block_num);
+                            kv::append_index_suffix(join_key_limit_block, scan.snapshot_block_num);
                         auto& row = rows.back();
-                        rdb::for_each(*it3, join_key_limit_block, join_key, [&](auto join_index_value, auto) {
+                        rdb::for_each(*it3, join_key_limit_block, join_key, [&](auto join_index_value, auto join_index_data) {
                             found_join            = true;
-                            auto join_delta_value = *rdb::get_raw(
-                                *it4, extract_pk_from_index(join_index_value, *query.join_table, query.join_query->index_obj->sort_keys),
-                                true);
+                            auto join_delta_value = get_indexed_row(
+                                *it4, join_index_value, join_index_data, *query.join_table, *query.join_query->index_obj);
                             std::vector<std::optional<uint32_t>> join_positions;
                             kv::init_positions(join_positions, query.join_table->fields.size());
                             fill_positions(join_delta_value, query.join_table->fields, join_positions);
@@ -143,16 +188,66 @@ struct rocksdb_query_session : query_session {
                 }
                 return false;
             });
-            return ++num_results < max_results;
+            ++num_results;
+            return true;
         });
+        scan.remaining = more ? scan.remaining - num_results : 0;
+    }
+
+    virtual std::vector<char> query_database(abieos::input_buffer query_bin, const state_history::fill_status& fill_status) override {
+        auto                       scan = parse_query(query_bin, fill_status);
+        std::optional<std::string> cache_key;
+        if (db_iface->result_cache) {
+            cache_key = query_result_cache::key(*scan.query, query_bin, scan.snapshot_block_num, fill_status);
+            if (cache_key)
+                if (auto cached = db_iface->result_cache->get(fill_status, *cache_key))
+                    return std::move(*cached);
+        }
+
+        std::vector<std::vector<char>> rows;
+        read_rows(scan, scan.remaining, rows);
 
         auto result = abieos::native_to_bin(rows);
         if ((uint32_t)result.size() != result.size())
             throw std::runtime_error("query_database: result is too big");
+        if (cache_key)
+            db_iface->result_cache->put(fill_status, *cache_key, result);
         return result;
     }
+
+    virtual std::unique_ptr<query_cursor>
+    open_cursor(abieos::input_buffer query_bin, const state_history::fill_status& fill_status) override;
 }; // rocksdb_query_session
 
+// Resumes the scan where the previous batch stopped. Shares the session's iterators; each batch
+// reseeks them, so cursors can interleave with each other and with query_database.
+struct rocksdb_query_cursor : query_cursor {
+    rocksdb_query_session&            session;
+    rocksdb_query_session::index_scan scan;
+
+    rocksdb_query_cursor(rocksdb_query_session& session, rocksdb_query_session::index_scan scan)
+        : session(session)
+        , scan(std::move(scan)) {}
+
+    virtual ~rocksdb_query_cursor() {}
+
+    virtual std::vector<char> next_batch(uint32_t max_rows) override {
+        // Keys hidden by the block snapshot produce no rows; keep going so an empty batch only means the end
+        std::vector<std::vector<char>> rows;
+        while (rows.empty() && scan.remaining)
+            session.read_rows(scan, max_rows, rows);
+        auto result = abieos::native_to_bin(rows);
+        if ((uint32_t)result.size() != result.size())
+            throw std::runtime_error("query_next_batch: result is too big");
+        return result;
+    }
+}; // rocksdb_query_cursor
+
+std::unique_ptr<query_cursor>
+rocksdb_query_session::open_cursor(abieos::input_buffer query_bin, const state_history::fill_status& fill_status) {
+    return std::make_unique<rocksdb_query_cursor>(*this, parse_query(query_bin, fill_status));
+}
+
 std::unique_ptr<query_session> rocksdb_database_interface::create_query_session() {
     auto session = std::make_unique<rocksdb_query_session>(shared_from_this());
     return session;